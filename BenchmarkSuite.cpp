@@ -0,0 +1,456 @@
+/*
+ * File Name: BenchmarkSuite.cpp
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the implementation of the end-to-end benchmark suite.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <ctime>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <filesystem>
+#include "BenchmarkSuite.h"
+#include "Huffman.h"
+#include "HuffmanAsync.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#define BENCHMARK_POSIX
+#endif
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+BenchmarkSuite::BenchmarkSuite(string executablePath, string workDirectory, unsigned long long maxCorpusSize, string label, size_t bufferSize)
+{
+	/*
+	 * BenchmarkSuite constructor. On Linux the executable is taken from /proc/self/exe, so it doesn't matter how the program was started.
+	*/
+
+	error_code error;
+	fs::path self = fs::read_symlink("/proc/self/exe", error);
+	this->executablePath = error ? executablePath : self.string();
+	this->workDirectory = workDirectory;
+	this->maxCorpusSize = maxCorpusSize;
+	this->label = label;
+	this->bufferSize = bufferSize;
+
+	// ISO 8601, in UTC so the history sorts the same on every machine
+	time_t now = time(nullptr);
+	char buffer[32];
+	strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	timestamp = buffer;
+}
+
+int BenchmarkSuite::Run()
+{
+	/*
+	 * Runs the whole suite, smallest corpora first. Returns -1 if any output didn't round-trip (or a command failed to run), otherwise 0.
+	 * The corpora are kept in the work directory and reused by the next run, everything else is removed as soon as it's been checked.
+	*/
+
+	const unsigned long long sizes[4] = { 1ULL << 20, 16ULL << 20, 256ULL << 20, 4096ULL << 20 }; // The 4GB corpora need the 64-bit frequency counts, with int counts their trees come out wrong
+	const string kinds[3] = { "text", "random", "skewed" };
+	int hardwareThreads = (int)thread::hardware_concurrency() > 0 ? (int)thread::hardware_concurrency() : 1;
+	int failures = 0;
+
+	error_code error;
+	fs::create_directories(workDirectory, error);
+	if (!fs::is_directory(workDirectory, error))
+	{
+		cout << "Work directory cannot be created!" << endl;
+		return -1;
+	}
+
+	cout << left << setw(6) << "Cmd" << setw(18) << "Corpus" << right << setw(8) << "Threads" << setw(12) << "Seconds" << setw(12) << "MB/s"
+		<< setw(14) << "Peak RSS (KB)" << setw(14) << "Bytes in" << setw(14) << "Bytes out" << setw(6) << "OK" << endl;
+
+	for (int s = 0; s < 4 && sizes[s] <= maxCorpusSize; s++)
+	{
+		string sizeName = to_string(sizes[s] >> 20) + "MB";
+		fs::path encodedDirectory = fs::path(workDirectory) / ("encoded-" + sizeName); // The -e outputs of this size, the input to -dd
+		fs::create_directories(encodedDirectory, error);
+
+		for (int k = 0; k < 3; k++)
+		{
+			string corpus = kinds[k] + "-" + sizeName;
+			string corpusPath = (fs::path(workDirectory) / (corpus + ".bin")).string();
+			string treePath = (fs::path(workDirectory) / (corpus + ".htree")).string();
+			string encodedPath = (encodedDirectory / (corpus + ".huf")).string();
+			string treeEncodedPath = (fs::path(workDirectory) / (corpus + ".et.huf")).string();
+			string decodedPath = (fs::path(workDirectory) / (corpus + ".out")).string();
+			double seconds = 0;
+			long long peakRss = -1;
+
+			if (!GenerateCorpus(corpusPath, kinds[k], sizes[s]))
+			{
+				cout << "Corpus " << corpusPath << " cannot be written!" << endl;
+				return -1;
+			}
+
+			// -t, the tree-builder file is always the same size
+			bool ran = RunCommand({ "-t", corpusPath, treePath }, seconds, peakRss);
+			Record("-t", corpus, sizes[s], 1, seconds, peakRss, sizes[s], fs::file_size(treePath, error), ran && fs::file_size(treePath, error) == (uintmax_t)Huffman::TREE_BUILDER_SIZE);
+
+			// -e then -d, both are only right if the decoded file matches. The encoded file also has to be no bigger than a Huffman code can be,
+			// a round-trip alone can't catch a bad tree (e.g. from overflowing counts), any tree decodes back fine
+			unsigned long long sizeBound = EncodedSizeBound(corpusPath);
+			bool encoded = RunCommand({ "-e", corpusPath, encodedPath }, seconds, peakRss);
+			double encodeSeconds = seconds;
+			long long encodeRss = peakRss;
+			bool decoded = RunCommand({ "-d", encodedPath, decodedPath }, seconds, peakRss);
+			bool correct = encoded && decoded && SameContents(corpusPath, decodedPath);
+			bool encodeCorrect = correct && fs::file_size(encodedPath, error) <= sizeBound;
+			Record("-e", corpus, sizes[s], 1, encodeSeconds, encodeRss, sizes[s], fs::file_size(encodedPath, error), encodeCorrect);
+			Record("-d", corpus, sizes[s], 1, seconds, peakRss, fs::file_size(encodedPath, error), fs::file_size(decodedPath, error), correct);
+			fs::remove(decodedPath, error);
+
+			// -et with the tree from -t, checked with an extra (unrecorded) decode
+			encoded = RunCommand({ "-et", corpusPath, treePath, treeEncodedPath }, seconds, peakRss);
+			double dummySeconds = 0;
+			long long dummyRss = -1;
+			decoded = RunCommand({ "-d", treeEncodedPath, decodedPath }, dummySeconds, dummyRss);
+			correct = encoded && decoded && SameContents(corpusPath, decodedPath) && fs::file_size(treeEncodedPath, error) <= sizeBound;
+			Record("-et", corpus, sizes[s], 1, seconds, peakRss, sizes[s] + Huffman::TREE_BUILDER_SIZE, fs::file_size(treeEncodedPath, error), correct);
+
+			fs::remove(decodedPath, error);
+			fs::remove(treeEncodedPath, error);
+			fs::remove(treePath, error);
+		}
+
+		// -dd over every encoded corpus of this size, on one thread and then on all of them
+		vector<int> threadCounts = { 1 };
+		if (hardwareThreads > 1)
+			threadCounts.push_back(hardwareThreads);
+		for (size_t t = 0; t < threadCounts.size(); t++)
+		{
+			fs::path decodedDirectory = fs::path(workDirectory) / ("decoded-" + sizeName);
+			double seconds = 0;
+			long long peakRss = -1;
+			bool correct = RunCommand({ "-dd", encodedDirectory.string(), decodedDirectory.string(), to_string(threadCounts[t]) }, seconds, peakRss);
+
+			unsigned long long bytesIn = 0;
+			unsigned long long bytesOut = 0;
+			for (int k = 0; k < 3; k++)
+			{
+				string corpus = kinds[k] + "-" + sizeName;
+				bytesIn += fs::file_size(encodedDirectory / (corpus + ".huf"), error);
+				bytesOut += fs::file_size(decodedDirectory / corpus, error);
+				correct = correct && SameContents((fs::path(workDirectory) / (corpus + ".bin")).string(), (decodedDirectory / corpus).string());
+			}
+			Record("-dd", sizeName, 3 * sizes[s], threadCounts[t], seconds, peakRss, bytesIn, bytesOut, correct);
+			fs::remove_all(decodedDirectory, error);
+		}
+		fs::remove_all(encodedDirectory, error);
+	}
+
+	AppendHistory();
+
+	for (size_t i = 0; i < results.size(); i++)
+		if (!results[i].correct)
+			failures++;
+	cout << results.size() << " runs, " << failures << " failures. History appended to " << (fs::path(workDirectory) / "history.csv").string()
+		<< " and " << (fs::path(workDirectory) / "history.jsonl").string() << endl;
+	return failures > 0 ? -1 : 0;
+}
+
+bool BenchmarkSuite::GenerateCorpus(string filePath, string kind, unsigned long long size)
+{
+	/*
+	 * Writes one corpus, unless it's already there at the right size. Each kind has a fixed seed, so a corpus is byte for byte the same on every machine.
+	 *	text: words from a fixed 1024 word vocabulary, picked with Zipf's law, with spaces, punctuation and line breaks (compresses like prose)
+	 *	random: uniform random bytes (doesn't compress, every code is 8 bits)
+	 *	skewed: bytes with a geometric distribution (a deep tree, with codes far longer than the decode table)
+	*/
+
+	error_code error;
+	if (fs::file_size(filePath, error) == size && !error)
+		return true;
+
+	ofstream outputStream(filePath, ios::binary);
+	if (!outputStream.is_open())
+		return false;
+
+	mt19937_64 random(kind == "text" ? 1 : kind == "random" ? 2 : 3);
+	vector<char> buffer(1 << 20);
+	vector<string> words;
+	vector<double> wordCumulative; // Running total of the Zipf weights, a word is picked by where a random point lands in it
+	vector<unsigned char> skewedSymbols(1 << 16);
+
+	if (kind == "text")
+	{
+		for (int i = 0; i < 1024; i++)
+		{
+			string word;
+			int length = 2 + (int)(random() % 9);
+			for (int j = 0; j < length; j++)
+				word += (char)('a' + random() % 26);
+			words.push_back(word);
+			wordCumulative.push_back((i > 0 ? wordCumulative.back() : 0) + 1.0 / (i + 1));
+		}
+	}
+	else if (kind == "skewed")
+	{
+		// Each 16 random bits map to a symbol, symbol n turns up with probability 0.3 * 0.7^n
+		double cumulative = 0;
+		double probability = 0.3;
+		int symbol = 0;
+		for (int i = 0; i < (1 << 16); i++)
+		{
+			double point = (i + 0.5) / (1 << 16);
+			while (symbol < 255 && cumulative + probability < point)
+			{
+				cumulative += probability;
+				probability *= 0.7;
+				symbol++;
+			}
+			skewedSymbols[i] = (unsigned char)symbol;
+		}
+	}
+
+	string pending; // The word being written, it can run over into the next buffer
+	size_t pendingIndex = 0; // How much of it has been written
+	for (unsigned long long written = 0; written < size;)
+	{
+		size_t count = size - written < buffer.size() ? (size_t)(size - written) : buffer.size();
+		size_t i = 0;
+
+		if (kind == "text")
+		{
+			for (; i < count; i++)
+			{
+				if (pendingIndex == pending.length())
+				{
+					int mark = (int)(random() % 16);
+					double point = (double)(random() >> 11) / (1ULL << 53) * wordCumulative.back(); // The standard distributions differ between libraries, this doesn't
+					size_t word = upper_bound(wordCumulative.begin(), wordCumulative.end(), point) - wordCumulative.begin();
+					pending = words[word < words.size() ? word : words.size() - 1] + (mark == 0 ? ".\n" : mark == 1 ? ", " : " ");
+					pendingIndex = 0;
+				}
+				buffer[i] = pending[pendingIndex++];
+			}
+		}
+		else if (kind == "random")
+		{
+			for (; i + 8 <= count; i += 8)
+			{
+				unsigned long long value = random();
+				memcpy(&buffer[i], &value, 8);
+			}
+			for (; i < count; i++)
+				buffer[i] = (char)random();
+		}
+		else
+		{
+			for (; i < count; i += 4)
+			{
+				unsigned long long value = random();
+				for (size_t j = 0; j < 4 && i + j < count; j++)
+					buffer[i + j] = (char)skewedSymbols[(value >> (16 * j)) & 0xFFFF];
+			}
+		}
+
+		outputStream.write(buffer.data(), count);
+		written += count;
+	}
+
+	outputStream.close();
+	return !outputStream.fail();
+}
+
+unsigned long long BenchmarkSuite::EncodedSizeBound(string corpusPath)
+{
+	/*
+	 * Works out the biggest a correct encode of the corpus can be. A Huffman code averages less than the order-0 entropy plus one bit a symbol,
+	 * so anything over entropy + 1 bits a symbol (plus the block header and a byte of padding) was encoded with the wrong tree.
+	 * Counted in 64 bits, the corpora go up to 4GB.
+	*/
+
+	ifstream inputStream(corpusPath, ios::binary);
+	vector<char> buffer(1 << 20);
+	unsigned long long counts[256] = {};
+	unsigned long long total = 0;
+
+	while (inputStream.read(buffer.data(), buffer.size()) || inputStream.gcount() > 0)
+	{
+		streamsize bytesRead = inputStream.gcount();
+		for (streamsize i = 0; i < bytesRead; i++)
+			counts[(unsigned char)buffer[i]]++;
+		total += (unsigned long long)bytesRead;
+	}
+
+	double entropy = 0;
+	for (int c = 0; c < 256; c++)
+	{
+		if (counts[c] == 0)
+			continue;
+		double probability = (double)counts[c] / total;
+		entropy -= probability * log2(probability);
+	}
+
+	return Huffman::BLOCK_HEADER_SIZE + (unsigned long long)ceil(total * (entropy + 1) / 8) + 1;
+}
+
+bool BenchmarkSuite::RunCommand(vector<string> args, double& seconds, long long& peakRss)
+{
+	/*
+	 * Runs this program with args (plus -b if it was given), with its output thrown away, and waits for it.
+	 * Gives back the wall time, and the peak RSS in KB (only on POSIX, -1 elsewhere). Returns false if it couldn't be run or didn't exit with 0.
+	*/
+
+	if (bufferSize > 0)
+	{
+		args.push_back("-b");
+		args.push_back(to_string(bufferSize / 1024));
+	}
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	peakRss = -1;
+
+#ifdef BENCHMARK_POSIX
+	vector<char*> argv;
+	argv.push_back((char*)executablePath.c_str());
+	for (size_t i = 0; i < args.size(); i++)
+		argv.push_back((char*)args[i].c_str());
+	argv.push_back(nullptr);
+
+	pid_t child = fork();
+	if (child < 0)
+		return false;
+	if (child == 0)
+	{
+		int devNull = open("/dev/null", O_WRONLY);
+		if (devNull >= 0)
+			dup2(devNull, STDOUT_FILENO);
+		execv(argv[0], argv.data());
+		_exit(127); // Only gets here if the exec failed
+	}
+
+	int status = 0;
+	struct rusage usage;
+	if (wait4(child, &status, 0, &usage) < 0)
+		return false;
+	seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+#ifdef __APPLE__
+	peakRss = (long long)usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+	peakRss = (long long)usage.ru_maxrss; // KB on Linux
+#endif
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+	string commandLine = "\"" + executablePath + "\"";
+	for (size_t i = 0; i < args.size(); i++)
+		commandLine += " \"" + args[i] + "\"";
+	int status = system((commandLine + " > NUL").c_str());
+	seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return status == 0;
+#endif
+}
+
+bool BenchmarkSuite::SameContents(string firstFilePath, string secondFilePath)
+{
+	/*
+	 * Compares two files a megabyte at a time, returns true only if they're both there and identical.
+	*/
+
+	ifstream firstStream(firstFilePath, ios::binary);
+	ifstream secondStream(secondFilePath, ios::binary);
+	if (!firstStream.is_open() || !secondStream.is_open())
+		return false;
+
+	vector<char> firstBuffer(1 << 20);
+	vector<char> secondBuffer(1 << 20);
+	while (true)
+	{
+		firstStream.read(firstBuffer.data(), firstBuffer.size());
+		secondStream.read(secondBuffer.data(), secondBuffer.size());
+		streamsize firstRead = firstStream.gcount();
+		if (firstRead != secondStream.gcount() || !equal(firstBuffer.begin(), firstBuffer.begin() + firstRead, secondBuffer.begin()))
+			return false;
+		if (firstRead == 0)
+			return true;
+	}
+}
+
+size_t BenchmarkSuite::EffectiveBufferSize(string command)
+{
+	/*
+	 * Works out the buffer size a command runs with, the same way main does from -b, so rows with and without -b can be compared.
+	 * Without -b the single file commands get the Huffman default and the -dd workers get the smaller per-worker default.
+	*/
+
+	Huffman sizing(command == "-dd" ? HuffmanAsync::DEFAULT_WORKER_MEMORY_BUDGET : Huffman::DEFAULT_MEMORY_BUDGET); // Buffers aren't allocated until used
+	if (bufferSize > 0)
+		sizing.SetBufferSize(bufferSize);
+	return sizing.GetBufferSize();
+}
+
+void BenchmarkSuite::Record(string command, string corpus, unsigned long long corpusSize, int threads, double seconds, long long peakRss, unsigned long long bytesIn, unsigned long long bytesOut, bool correct)
+{
+	/*
+	 * Saves one row for the history and prints it. MB/s is always of the corpus, so encode and decode are comparable.
+	*/
+
+	Result result = { command, corpus, corpusSize, threads, EffectiveBufferSize(command), seconds, peakRss, bytesIn, bytesOut, correct };
+	results.push_back(result);
+
+	cout << left << setw(6) << command << setw(18) << corpus << right << setw(8) << threads << fixed << setprecision(3) << setw(12) << seconds
+		<< setprecision(1) << setw(12) << (seconds > 0 ? corpusSize / (1024.0 * 1024.0) / seconds : 0) << setw(14) << peakRss
+		<< setw(14) << bytesIn << setw(14) << bytesOut << setw(6) << (correct ? "yes" : "NO") << endl;
+}
+
+void BenchmarkSuite::AppendHistory()
+{
+	/*
+	 * Appends this run's rows to history.csv (with a header line if it's new) and to history.jsonl (one JSON object per line).
+	*/
+
+	fs::path csvPath = fs::path(workDirectory) / "history.csv";
+	fs::path jsonPath = fs::path(workDirectory) / "history.jsonl";
+	error_code error;
+	bool newCsv = !fs::exists(csvPath, error);
+
+	// The label is the only free text, keep it from breaking either format
+	string safeLabel;
+	for (size_t i = 0; i < label.length(); i++)
+		if (label[i] != '"' && label[i] != '\\' && label[i] != ',' && (unsigned char)label[i] >= ' ')
+			safeLabel += label[i];
+
+	ofstream csvStream(csvPath, ios::app);
+	ofstream jsonStream(jsonPath, ios::app);
+	if (newCsv)
+		csvStream << "timestamp,label,command,corpus,corpus_bytes,threads,buffer_kb,seconds,mb_per_second,peak_rss_kb,bytes_in,bytes_out,round_trip" << endl;
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		double megaBytesPerSecond = r.seconds > 0 ? r.corpusSize / (1024.0 * 1024.0) / r.seconds : 0;
+
+		ostringstream row;
+		row << fixed << setprecision(4);
+		row << timestamp << "," << safeLabel << "," << r.command << "," << r.corpus << "," << r.corpusSize << "," << r.threads << "," << r.bufferSize / 1024 << ","
+			<< r.seconds << "," << megaBytesPerSecond << "," << r.peakRss << "," << r.bytesIn << "," << r.bytesOut << "," << (r.correct ? "true" : "false");
+		csvStream << row.str() << endl;
+
+		ostringstream object;
+		object << fixed << setprecision(4);
+		object << "{\"timestamp\":\"" << timestamp << "\",\"label\":\"" << safeLabel << "\",\"command\":\"" << r.command << "\",\"corpus\":\"" << r.corpus
+			<< "\",\"corpus_bytes\":" << r.corpusSize << ",\"threads\":" << r.threads << ",\"buffer_kb\":" << r.bufferSize / 1024 << ",\"seconds\":" << r.seconds
+			<< ",\"mb_per_second\":" << megaBytesPerSecond << ",\"peak_rss_kb\":" << r.peakRss << ",\"bytes_in\":" << r.bytesIn << ",\"bytes_out\":" << r.bytesOut
+			<< ",\"round_trip\":" << (r.correct ? "true" : "false") << "}";
+		jsonStream << object.str() << endl;
+	}
+}
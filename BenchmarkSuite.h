@@ -0,0 +1,62 @@
+/*
+ * File Name: BenchmarkSuite.h
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the definitions of the end-to-end benchmark suite; it runs the real command line paths over generated corpora
+ * and appends every result to a CSV and a JSON lines history file, so throughput and ratio can be tracked from build to build.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class BenchmarkSuite
+{
+	/*
+	 * BenchmarkSuite class. Generates a fixed set of corpora (text, random and skewed bytes, 1MB up to 4GB), then runs -t, -e, -d and -et on each
+	 * and -dd over each size with 1 and every hardware thread. Every command is a separate run of this program, so the wall time and peak RSS are
+	 * exactly those of the command. Every output is checked against its corpus.
+	*/
+
+public:
+	BenchmarkSuite(string executablePath, string workDirectory, unsigned long long maxCorpusSize, string label, size_t bufferSize);
+
+	int Run();
+
+	static const unsigned long long DEFAULT_MAX_CORPUS_SIZE = 256ULL * 1024 * 1024; // The 4GB corpora take a while (and ~30GB of disk), so they have to be asked for
+
+private:
+	struct Result // One row of the history
+	{
+		string command; // The command that was run, e.g. "-e"
+		string corpus; // The corpus it was run on, or the size for -dd
+		unsigned long long corpusSize; // Size of the corpus (or all the corpora of the size, for -dd) in bytes
+		int threads; // Threads the command used
+		size_t bufferSize; // Buffer size the command actually ran with (per worker, for -dd), in bytes
+		double seconds; // Wall time of the whole command
+		long long peakRss; // Peak resident set size of the command in KB, -1 if it couldn't be measured
+		unsigned long long bytesIn; // Bytes the command read
+		unsigned long long bytesOut; // Bytes the command wrote
+		bool correct; // Whether the output round-tripped (and, for -e/-et, is no bigger than a Huffman code allows; for -t, is a tree-builder file)
+	};
+
+	string executablePath; // This program, every command is run as a new process of it
+	string workDirectory; // Where the corpora, the temporary outputs and the history files go
+	unsigned long long maxCorpusSize; // Corpora bigger than this are skipped
+	string label; // Free text saved with every row, e.g. the commit being benchmarked
+	size_t bufferSize; // Passed on as -b (in bytes), 0 to leave the default
+	string timestamp; // When the run started, the same for every row of the run
+	vector<Result> results; // Every row of this run, written out at the end
+
+	bool GenerateCorpus(string filePath, string kind, unsigned long long size);
+	unsigned long long EncodedSizeBound(string corpusPath);
+	bool RunCommand(vector<string> args, double& seconds, long long& peakRss);
+	bool SameContents(string firstFilePath, string secondFilePath);
+	size_t EffectiveBufferSize(string command);
+	void Record(string command, string corpus, unsigned long long corpusSize, int threads, double seconds, long long peakRss, unsigned long long bytesIn, unsigned long long bytesOut, bool correct);
+	void AppendHistory();
+};
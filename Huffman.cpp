@@ -9,18 +9,83 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <cctype>
+#include <climits>
+#include <new>
+#include <cstdint>
+#include <cstring>
 #include "Huffman.h"
-#include "LookupTables.h"
+#include "Profiler.h"
+
+// The AVX2 encode kernel is only compiled for x86, every other platform sticks to the scalar kernel
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HUFFMAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 using namespace std;
 
-// This constant is used for fine tuning the speed/memory ratio. It represents how large the read/write buffers should be when accessing files
-const int READ_WRITE_BUFFER_SIZE = 8 * 1024 * 1024; // TotalBytes = #ofMegaBytes * 1024(KB) * 1024(B)
+static bool CpuSupportsAVX2()
+{
+	/*
+	 * Runtime CPU detection, checks that both the CPU and the OS (saving the YMM registers) support AVX2.
+	*/
+
+#if defined(HUFFMAN_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) // OSXSAVE, and the OS saves the XMM and YMM state
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0; // AVX2
+#elif defined(HUFFMAN_X86)
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+Huffman::Huffman(size_t memoryBudget)
+{
+	/*
+	 * Huffman constructor. The memoryBudget is used for fine tuning the speed/memory ratio, it's split evenly between the input and output buffers.
+	 * The buffers themselves aren't allocated until they are first needed, and are then reused by every call on this instance.
+	*/
+
+	nodePoolIndex = 0;
+	inputBuffer = nullptr;
+	outputBuffer = nullptr;
+	bufferAlignment = CACHE_LINE_SIZE;
+	useAVX2 = CpuSupportsAVX2();
+	SetBufferSize(memoryBudget / 2);
+}
 
-void Huffman::EncodeFile(string inputFilePath, string outputFilePath)
+Huffman::~Huffman()
 {
 	/*
-	 * Encodes a file specified by inputFilePath to an output file, specified by outputFilePath (optional)
+	 * Huffman destructor. Frees the read/write buffers, the nodes are part of the instance so there's nothing else to free.
+	*/
+
+	FreeBuffers();
+}
+
+bool Huffman::EncodeFile(string inputFilePath, string outputFilePath, bool sampled)
+{
+	/*
+	 * Encodes a file specified by inputFilePath to an output file, specified by outputFilePath (optional). Returns false if it failed.
+	 * With sampled set, the tree is built from a sample of the file instead of all of it (see EncodeStream).
 	 */
 
 	 // Open the input file and check that it opened correctly
@@ -29,7 +94,7 @@ void Huffman::EncodeFile(string inputFilePath, string outputFilePath)
 	if (!inputStream.is_open())
 	{
 		cout << "Input file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
 	// Open the output file and check that it opened correctly
@@ -38,29 +103,47 @@ void Huffman::EncodeFile(string inputFilePath, string outputFilePath)
 	if (!outputStream.is_open())
 	{
 		cout << "Output file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
-	unsigned char rows[510]; // This is the tree-builder rows that are written to a .htree file
-	Node* root; // Root node, no need to have it declared in the class as it's only really used here
-	string bStrings[256]; // Array of all the possible string paths to each of the 256 characters in the huffman tree (once it's built!)
-	string tempBString; // Temporary variable, only used for providing a spot for each traversal to write to, it used for calculating the paths to each leaf node.
-
-	root = BuildTree(inputStream, outputStream, rows); // Build the tree, no output to file!
-	TraverseAndBuild(root, tempBString, bStrings); // Traverse through the entire tree, building up the paths and storing them in the bStrings array
-	EncodeAndWrite(inputStream, outputStream, bStrings); // Go back through the file, converting and writing all the data to the outputStream
+	bool success = EncodeStream(inputStream, outputStream, sampled);
 
 	// Close the streams
 	if (inputStream.is_open())
 		inputStream.close();
 	if (outputStream.is_open())
 		outputStream.close();
+	return success;
 }
 
-void Huffman::DecodeFile(string inputFilePath, string outputFilePath)
+bool Huffman::EncodeStream(istream& inputStream, ostream& outputStream, bool sampled)
 {
 	/*
-	 * Decodes a file located at inputFilePath and writes the now decoded file to outputFilePath
+	 * Encodes everything in the inputStream into the outputStream, as one block. Both streams have to be seekable, the input is read twice
+	 * and the bit count in the output is filled in at the end. Returns false if either stream failed.
+	 * With sampled set, the tree is built from SAMPLE_CHUNK_COUNT chunks of the input instead, so a big input is only read in full once.
+	 * The output is a normal block, it just might be a little bigger (AnalyzeFile reports by how much).
+	 */
+
+	unsigned char rows[510]; // This is the tree-builder rows that are written to a .htree file
+
+	WriteBlockMagic(outputStream); // Mark the block as this format
+	BuildTree(inputStream, outputStream, rows, sampled); // Build the tree, and write the tree-builder rows as the header
+	streampos lengthPosition = outputStream.tellp();
+	WriteBlockLength(outputStream, 0); // Placeholder for the bit count, we don't know it until the data has been encoded
+	codec.Build(rows); // Build the code tables for the tree, giving the path to each of the 256 characters
+	unsigned long long bitCount = EncodeAndWrite(inputStream, outputStream); // Go back through the file, converting and writing all the data to the outputStream
+	outputStream.seekp(lengthPosition);
+	WriteBlockLength(outputStream, bitCount); // Go back and fill in the real bit count
+	outputStream.seekp(0, ios::end);
+
+	return !outputStream.fail() && !inputStream.bad();
+}
+
+bool Huffman::DecodeFile(string inputFilePath, string outputFilePath)
+{
+	/*
+	 * Decodes a file located at inputFilePath and writes the now decoded file to outputFilePath. Returns false if it failed.
 	 */
 
 	 // Open the input file and check that it opened correctly
@@ -69,7 +152,7 @@ void Huffman::DecodeFile(string inputFilePath, string outputFilePath)
 	if (!inputStream.is_open())
 	{
 		cout << "Input file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
 	// Open the output file and check that it opened correctly
@@ -78,23 +161,57 @@ void Huffman::DecodeFile(string inputFilePath, string outputFilePath)
 	if (!outputStream.is_open())
 	{
 		cout << "Output file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
-	// Declare, init, and read the tree-builder info from the inputStream file
-	unsigned char rows[510];
-	inputStream.read((char*)&rows, 510);
-	Node* root = BuildTree(rows);
-	DecodeAndWrite(inputStream, outputStream, root);
+	bool success = DecodeStream(inputStream, outputStream);
 
 	// Close the streams
 	if (inputStream.is_open())
 		inputStream.close();
 	if (outputStream.is_open())
 		outputStream.close();
+	return success;
 }
 
-void Huffman::MakeTreeBuilder(string inputFilePath, string outputFilePath)
+bool Huffman::DecodeStream(istream& inputStream, ostream& outputStream)
+{
+	/*
+	 * Decodes everything in the inputStream into the outputStream. Returns false if the input isn't a valid encoded file, or the output failed.
+	 */
+
+	/*
+	 * The file is one or more blocks (more than one once something has been appended to it with -ab), each decoded in turn:
+	 *	1. Check the block marker, so files from older versions (which had no marker) aren't decoded into garbage
+	 *	2. Read the tree-builder info and rebuild the tree
+	 *	3. Read the bit count, which tells us how many bytes of encoded data follow
+	 *	4. Decode exactly those bytes
+	*/
+	unsigned char rows[510];
+	unsigned long long bitCount;
+	while (inputStream.peek() != EOF)
+	{
+		if (!ReadBlockMagic(inputStream))
+		{
+			cout << "Input file is not a valid encoded file! (Files encoded by versions before the block marker can't be decoded.)" << endl;
+			return false;
+		}
+		if (!inputStream.read((char*)&rows, 510) || !ReadBlockLength(inputStream, bitCount) || !codec.Build(rows)) // The decode table handles the short codes, the flat decode tree the long ones
+		{
+			cout << "Input file is not a valid encoded file!" << endl;
+			return false;
+		}
+		if (!DecodeAndWrite(inputStream, outputStream, bitCount)) // The bit count claims more data than the file has
+		{
+			cout << "Input file is not a valid encoded file!" << endl;
+			return false;
+		}
+	}
+
+	return !outputStream.fail();
+}
+
+bool Huffman::MakeTreeBuilder(string inputFilePath, string outputFilePath)
 {
 	/*
 	 * Generates a .htree file from an input file (supplied by inputFilePath) and writes the output to an configurable outputFilePath.
@@ -106,7 +223,7 @@ void Huffman::MakeTreeBuilder(string inputFilePath, string outputFilePath)
 	if (!inputStream.is_open())
 	{
 		cout << "Input file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
 	// Open the output file and check that it opened correctly
@@ -115,21 +232,23 @@ void Huffman::MakeTreeBuilder(string inputFilePath, string outputFilePath)
 	if (!outputStream.is_open())
 	{
 		cout << "Output file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
 	// Declare our local var rows and call the build tree function
 	unsigned char rows[510];
 	BuildTree(inputStream, outputStream, rows);
+	bool success = !outputStream.fail() && !inputStream.bad();
 
 	// Close the streams
 	if (inputStream.is_open())
 		inputStream.close();
 	if (outputStream.is_open())
 		outputStream.close();
+	return success;
 }
 
-void Huffman::EncodeFileWithTree(string inputFilePath, string outputFilePath, string treeBuilderFilePath)
+bool Huffman::EncodeFileWithTree(string inputFilePath, string outputFilePath, string treeBuilderFilePath)
 {
 	/*
 	 * Encodes a file, specified by inputFilePath, using the tree building data that will found at treeBuilderFilePath.
@@ -142,7 +261,7 @@ void Huffman::EncodeFileWithTree(string inputFilePath, string outputFilePath, st
 	if (!inputStream.is_open())
 	{
 		cout << "Input file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
 	// Open the input file and check that it opened correctly
@@ -151,7 +270,7 @@ void Huffman::EncodeFileWithTree(string inputFilePath, string outputFilePath, st
 	if (!inputTreeStream.is_open())
 	{
 		cout << "Input Tree-Builder file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
 	// Open the output file and check that it opened correctly
@@ -160,19 +279,26 @@ void Huffman::EncodeFileWithTree(string inputFilePath, string outputFilePath, st
 	if (!outputStream.is_open())
 	{
 		cout << "Output file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
-		return;
+		return false;
 	}
 
 	// Declare, init, and read the tree-builder info from the inputStream file
 	unsigned char rows[510];
 	inputTreeStream.read((char*)&rows, 510);
-	Node* root = BuildTree(rows);
-	string bStrings[256];
-	string tempBString;
+	if (inputTreeStream.gcount() != 510 || !codec.Build(rows)) // Build the code tables for the tree, giving the path to each of the 256 characters
+	{
+		cout << "Input Tree-Builder file is not a valid tree-builder file!" << endl;
+		return false;
+	}
 
+	WriteBlockMagic(outputStream); // Mark the block as this format
 	outputStream.write((char*)rows, 510); // Write the tree builder data as the header
-	TraverseAndBuild(root, tempBString, bStrings); // Traverse through the entire tree, building up the paths and storing them in the bStrings array
-	EncodeAndWrite(inputStream, outputStream, bStrings); // Go back through the file, converting and writing all the data to the outputStream
+	streampos lengthPosition = outputStream.tellp();
+	WriteBlockLength(outputStream, 0); // Placeholder for the bit count, we don't know it until the data has been encoded
+	unsigned long long bitCount = EncodeAndWrite(inputStream, outputStream); // Go back through the file, converting and writing all the data to the outputStream
+	outputStream.seekp(lengthPosition);
+	WriteBlockLength(outputStream, bitCount); // Go back and fill in the real bit count
+	bool success = !outputStream.fail() && !inputStream.bad();
 
 	// Close the streams
 	if (inputStream.is_open())
@@ -181,6 +307,296 @@ void Huffman::EncodeFileWithTree(string inputFilePath, string outputFilePath, st
 		inputStream.close();
 	if (outputStream.is_open())
 		outputStream.close();
+	return success;
+}
+
+bool Huffman::GenerateCodebook(string treeBuilderFilePath, string headerFilePath, string name)
+{
+	/*
+	 * Turns a tree-builder file into a header that compiles the tree into the binary; a struct holding the rows as a constexpr array,
+	 * and the code and decode tables built from them by the compiler (TableBuilder::Make), plus a HuffmanCore::FixedCodec typedef to use them with.
+	 * The struct is called 'name', or after the header file if that's empty. Anything that isn't a letter, digit or '_' becomes a '_'.
+	*/
+
+	// Open the tree-builder file and check that it opened correctly
+	ifstream inputTreeStream;
+	inputTreeStream.open(treeBuilderFilePath, ios::binary);
+	if (!inputTreeStream.is_open())
+	{
+		cout << "Input Tree-Builder file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
+		return false;
+	}
+
+	// Read the rows, and make sure they're a tree before writing anything the compiler would choke on
+	unsigned char rows[510];
+	inputTreeStream.read((char*)&rows, 510);
+	if (inputTreeStream.gcount() != 510 || !codec.Build(rows))
+	{
+		cout << "Input Tree-Builder file is not a valid tree-builder file!" << endl;
+		return false;
+	}
+
+	// Default the name to the header file name, without its directory or extension
+	if (name.empty())
+	{
+		size_t slash = headerFilePath.find_last_of("/\\");
+		name = slash == string::npos ? headerFilePath : headerFilePath.substr(slash + 1);
+		name = name.substr(0, name.find('.'));
+	}
+	for (size_t i = 0; i < name.length(); i++)
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+			name[i] = '_';
+	if (name.empty() || isdigit((unsigned char)name[0]))
+		name = "_" + name;
+
+	// Open the output file and check that it opened correctly
+	ofstream outputStream;
+	outputStream.open(headerFilePath, ios::binary);
+	if (!outputStream.is_open())
+	{
+		cout << "Output file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
+		return false;
+	}
+
+	string tables = "HuffmanCore::CodeTables<8, " + to_string(DECODE_TABLE_BITS) + ", " + to_string(MAX_FAST_CODE_LENGTH) + ">";
+	string builder = "HuffmanCore::TableBuilder<8, " + to_string(DECODE_TABLE_BITS) + ", " + to_string(MAX_FAST_CODE_LENGTH) + ">";
+
+	outputStream << "/*" << endl;
+	outputStream << " * Brief Description: The compiled-in codebook " << name << ", generated by '-gen' from " << treeBuilderFilePath << ". Don't edit it, regenerate it." << endl;
+	outputStream << " * The tables are built by the compiler, so there's no file to read and no tree to build at run time. Encode and decode with " << name << "Codec." << endl;
+	outputStream << "*/" << endl << endl;
+	outputStream << "#pragma once" << endl << endl;
+	outputStream << "#include \"HuffmanCore.h\"" << endl << endl;
+	outputStream << "struct " << name << endl << "{" << endl;
+	outputStream << "\ttypedef " << tables << " Tables;" << endl << endl;
+	outputStream << "\tstatic constexpr unsigned char ROWS[510] = // The tree-builder rows, exactly as they were in the file" << endl << "\t{";
+	for (int i = 0; i < 510; i++)
+		outputStream << (i % 16 == 0 ? "\n\t\t" : " ") << (int)rows[i] << (i < 509 ? "," : "");
+	outputStream << endl << "\t};" << endl << endl;
+	outputStream << "\tstatic constexpr Tables TABLES = " << builder << "::Make(ROWS); // Built by the compiler" << endl;
+	outputStream << "};" << endl << endl;
+	outputStream << "typedef HuffmanCore::FixedCodec<" << name << "> " << name << "Codec;" << endl;
+
+	outputStream.close();
+	if (outputStream.fail())
+	{
+		cout << "Output file couldn't be written!" << endl;
+		return false;
+	}
+	cout << "Wrote codebook " << name << " to " << headerFilePath << endl;
+	return true;
+}
+
+void Huffman::AnalyzeFile(string inputFilePath)
+{
+	/*
+	 * Reports how well a file would compress, without writing anything. Only the frequency pass is run over the file, the tree and codes are built from the counts.
+	 * Prints the count and code of every character that occurs, followed by the average bits/symbol against the Shannon entropy, the max depth and the predicted output size.
+	*/
+
+	// Open the input file and check that it opened correctly
+	ifstream inputStream;
+	inputStream.open(inputFilePath, ios::binary);
+	if (!inputStream.is_open())
+	{
+		cout << "Input file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
+		return;
+	}
+
+	unsigned char rows[510];
+	Node* nodes[256];
+	long long counts[256];
+	Node* root = nullptr;
+	string tempBString;
+
+	// Same steps as BuildTree, but keeping hold of the counts before the nodes get merged
+	nodePoolIndex = 0;
+	for (int i = 0; i < 256; i++)
+		nodes[i] = NewNode(i, 0);
+	CalculateFrequencyCounts(inputStream, nodes);
+	for (int i = 0; i < 256; i++)
+		counts[i] = nodes[i]->count;
+	BuildSubTrees(nodes, rows);
+	root = nodes[0];
+	if (root == nullptr)
+		for (int i = 0; i < 256; i++)
+			if (nodes[i] != nullptr)
+				root = nodes[i];
+	TraverseAndBuild(root, tempBString, bStrings);
+
+	// Tally everything up, only the characters that actually occur count towards the averages
+	long long totalSymbols = 0;
+	long long totalBits = 0;
+	int distinctSymbols = 0;
+	size_t maxDepth = 0;
+	size_t treeDepth = 0;
+	double entropy = 0;
+
+	for (int i = 0; i < 256; i++)
+	{
+		totalSymbols += counts[i];
+		if (bStrings[i].length() > treeDepth)
+			treeDepth = bStrings[i].length();
+	}
+
+	cout << setw(8) << "Symbol" << setw(14) << "Count" << setw(8) << "Length" << "  Code" << endl;
+	for (int i = 0; i < 256; i++)
+	{
+		if (counts[i] == 0)
+			continue;
+
+		double probability = (double)counts[i] / totalSymbols;
+		entropy -= probability * log2(probability);
+		totalBits += counts[i] * (long long)bStrings[i].length();
+		distinctSymbols++;
+		if (bStrings[i].length() > maxDepth)
+			maxDepth = bStrings[i].length();
+
+		// Show printable characters as themselves, everything else as hex
+		ostringstream symbol;
+		if (isprint(i) && i != ' ')
+			symbol << "'" << (char)i << "'";
+		else
+			symbol << "0x" << hex << setw(2) << setfill('0') << i;
+		cout << setw(8) << symbol.str() << setw(14) << counts[i] << setw(8) << bStrings[i].length() << "  " << bStrings[i] << endl;
+	}
+
+	long long predictedSize = BLOCK_HEADER_SIZE + (totalBits + 7) / 8; // Block header plus the encoded data
+	double averageBits = totalSymbols > 0 ? (double)totalBits / totalSymbols : 0;
+	cout << endl;
+	cout << "Symbols: " << totalSymbols << " (" << distinctSymbols << " distinct)" << endl;
+	cout << fixed << setprecision(4);
+	cout << "Average bits/symbol: " << averageBits << " (Shannon entropy: " << entropy << ", overhead: " << averageBits - entropy << ")" << endl;
+	cout << "Max depth: " << maxDepth << " (" << treeDepth << " counting characters that never occur)" << endl;
+	cout << "Predicted output size: " << predictedSize << " bytes (" << setprecision(2) << (totalSymbols > 0 ? 100.0 * predictedSize / totalSymbols : 0) << "% of the input)" << endl;
+
+	// Build the tree a sampled encode (-es) would use, and work out what it would cost against the exact counts
+	nodePoolIndex = 0;
+	for (int i = 0; i < 256; i++)
+		nodes[i] = NewNode(i, 0);
+	long long sampledBytes = CalculateSampledCounts(inputStream, nodes);
+	BuildSubTrees(nodes, rows);
+	TraverseAndBuild(BuildTree(rows), tempBString, bStrings);
+
+	long long sampledBits = 0;
+	for (int i = 0; i < 256; i++)
+		sampledBits += counts[i] * (long long)bStrings[i].length();
+	long long sampledSize = BLOCK_HEADER_SIZE + (sampledBits + 7) / 8;
+	cout << "Sampled tree (-es): " << sampledSize << " bytes predicted from a " << sampledBytes << " byte sample, " << setprecision(3)
+		<< (predictedSize > 0 ? 100.0 * (sampledSize - predictedSize) / predictedSize : 0) << "% bigger than the exact tree" << endl;
+
+	inputStream.close();
+}
+
+bool Huffman::AppendFile(string inputFilePath, string archiveFilePath, bool newBlock)
+{
+	/*
+	 * Appends the file at inputFilePath to an already encoded file at archiveFilePath, without touching the data already in there.
+	 * With newBlock set, the input gets its own block with a fresh tree built just for it (best ratio).
+	 * Otherwise the input is encoded with the tree of the last block, carrying on from its last partial byte (no new header at all).
+	 * Either way only the block headers of the archive are read, so the cost only depends on the size of the new data.
+	*/
+
+	// Open the input file and check that it opened correctly
+	ifstream inputStream;
+	inputStream.open(inputFilePath, ios::binary);
+	if (!inputStream.is_open())
+	{
+		cout << "Input file cannot be opened! Please check that the drive exists and that it is NOT read-only." << endl;
+		return false;
+	}
+
+	// Open the archive for both reading and writing. If it doesn't exist yet, there's nothing to append to, so just encode the input into it.
+	fstream archiveStream;
+	archiveStream.open(archiveFilePath, ios::binary | ios::in | ios::out);
+	if (!archiveStream.is_open())
+	{
+		inputStream.close();
+		return EncodeFile(inputFilePath, archiveFilePath);
+	}
+
+	bool success = AppendStream(inputStream, archiveStream, newBlock);
+
+	// Close the streams
+	if (inputStream.is_open())
+		inputStream.close();
+	if (archiveStream.is_open())
+		archiveStream.close();
+	return success;
+}
+
+bool Huffman::AppendStream(istream& inputStream, iostream& archiveStream, bool newBlock)
+{
+	/*
+	 * Appends everything in the inputStream to the encoded data in the archiveStream, the same way as AppendFile. Both streams have to be seekable.
+	 * An empty archiveStream just gets a new block. Returns false if the archive isn't a valid encoded file, or a stream failed.
+	*/
+
+	// Hop from block header to block header until we find the last one
+	unsigned char rows[510];
+	unsigned long long bitCount = 0;
+	streampos blockPosition = 0;
+	streampos lastBlockPosition = -1;
+	unsigned long long lastBitCount = 0;
+	while (ReadBlockMagic(archiveStream) && archiveStream.read((char*)rows, 510) && ReadBlockLength(archiveStream, bitCount))
+	{
+		lastBlockPosition = blockPosition;
+		lastBitCount = bitCount;
+		blockPosition += (streamoff)(BLOCK_HEADER_SIZE + bitCount / 8 + (bitCount % 8 != 0 ? 1 : 0)); // (bitCount + 7) / 8 would wrap on a damaged count
+		archiveStream.seekg(blockPosition);
+	}
+	archiveStream.clear();
+
+	// The blocks have to cover the whole archive, otherwise it's not an encoded file (or one from before the block marker) and appending would wreck it
+	archiveStream.seekg(0, ios::end);
+	if (archiveStream.tellg() != blockPosition)
+	{
+		cout << "Archive file is not a valid encoded file! (Files encoded by versions before the block marker can't be appended to.)" << endl;
+		return false;
+	}
+
+	if (newBlock || lastBlockPosition == streampos(-1))
+	{
+		// Build a fresh tree for the new data and write a whole new block after the last one
+		archiveStream.seekp(blockPosition);
+		WriteBlockMagic(archiveStream);
+		BuildTree(inputStream, archiveStream, rows);
+		streampos lengthPosition = archiveStream.tellp();
+		WriteBlockLength(archiveStream, 0); // Placeholder for the bit count
+		codec.Build(rows);
+		bitCount = EncodeAndWrite(inputStream, archiveStream);
+		archiveStream.seekp(lengthPosition);
+		WriteBlockLength(archiveStream, bitCount);
+	}
+	else
+	{
+		// Reload the tree of the last block
+		archiveStream.seekg(lastBlockPosition + (streamoff)HuffmanCore::BLOCK_MAGIC_SIZE);
+		archiveStream.read((char*)rows, 510);
+		if (!codec.Build(rows))
+		{
+			cout << "Archive file is not a valid encoded file!" << endl;
+			return false;
+		}
+
+		// If the last byte is only partly used, pick up its bits (dropping the padding) and write over it
+		streampos lastBytePosition = lastBlockPosition + (streamoff)(BLOCK_HEADER_SIZE + lastBitCount / 8);
+		int partialBits = (int)(lastBitCount % 8);
+		char partialByte = 0;
+		if (partialBits > 0)
+		{
+			archiveStream.seekg(lastBytePosition);
+			archiveStream.read(&partialByte, 1);
+			partialByte = (char)((unsigned char)partialByte >> (8 - partialBits));
+		}
+
+		archiveStream.seekp(lastBytePosition);
+		bitCount = EncodeAndWrite(inputStream, archiveStream, (unsigned char)partialByte, partialBits);
+		archiveStream.seekp(lastBlockPosition + (streamoff)(HuffmanCore::BLOCK_MAGIC_SIZE + 510));
+		WriteBlockLength(archiveStream, lastBitCount + bitCount); // The block now holds the old and the new bits
+	}
+
+	return !archiveStream.fail() && !inputStream.bad();
 }
 
 void Huffman::DisplayHelp()
@@ -191,31 +607,123 @@ void Huffman::DisplayHelp()
 
 	cout << "-e file1 [file2]			: Encodes File1, placing the output into File2 (optional)" << endl;
 	cout << "-d file1 file2				: Decodes File1, placing it into File2" << endl;
+	cout << "-es file1 [file2]			: Same as -e, but the tree is built from a sample of File1, so File1 is only read in full once (slightly bigger output)" << endl;
 	cout << "-t file1 [file2]			: Produces the tree builder file from File1 and places it into File2 (optional)" << endl;
 	cout << "-et file1 file2 [file3]	: Encode file1 using a prebuild tree in file2, and placing the output inot file3 (optional)" << endl;
+	cout << "-dd dir1 dir2 [threads]		: Decodes every .huf file under Dir1 (or listed in a list file), in parallel, into the same relative paths under Dir2" << endl;
+	cout << "-gen file1 file2 [name]		: Generates a header from the tree-builder File1 into File2, with the tree's tables built at compile time and a codec that uses them" << endl;
+	cout << "-a file1 file2				: Appends File1 to the already encoded File2, using the tree of the last block in File2" << endl;
+	cout << "-ab file1 file2				: Appends File1 to the already encoded File2 as a new block, with its own tree" << endl;
+	cout << "-stats || -analyze file1		: Prints the code of every character in File1, the average bits/symbol vs entropy and the predicted output size (exact and sampled tree), without writing anything" << endl;
+	cout << "-bench file1				: Encodes and decodes File1 with a range of buffer sizes, reporting the throughput of each" << endl;
+	cout << "-benchsuite dir1 [MB] [label]	: Runs -t, -e, -d, -et and -dd over generated corpora (up to MB, default 256) in Dir1, appending the times, peak RSS, sizes and round-trip checks to Dir1/history.csv and .jsonl" << endl;
+	cout << "-fuzz count [seed]			: Round-trips the edge cases and Count random inputs through every encoder and decoder, checking them against a bit-at-a-time reference" << endl;
+	cout << "-b KB						: (any command) Sets the size of each read/write buffer in KB, default is 8192" << endl;
+	cout << "--profile					: (any command) Prints a cycles/byte breakdown of each phase, needs a build with HUFFMAN_PROFILE defined" << endl;
 	cout << "-help || -? || -h			: displays this list of available commands" << endl;
 }
 
-Huffman::Node* Huffman::BuildTree(ifstream& inputStream, ofstream& outputStream, unsigned char rows[])
+void Huffman::SetBufferSize(size_t size)
+{
+	/*
+	 * Sets the size of each of the two read/write buffers. Any buffers already allocated are freed, the new ones are allocated on the next call.
+	 * Big buffers are rounded up to a whole number of huge pages, so they can be backed by huge pages when the OS allows it.
+	*/
+
+	if (size < MIN_BUFFER_SIZE)
+		size = MIN_BUFFER_SIZE;
+	if (size >= HUGE_PAGE_SIZE)
+		size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+	FreeBuffers();
+	bufferSize = size;
+}
+
+size_t Huffman::GetBufferSize()
+{
+	/*
+	 * Returns the size of each of the two read/write buffers.
+	*/
+
+	return bufferSize;
+}
+
+Huffman::Node* Huffman::NewNode(int symbol, long long count)
+{
+	/*
+	 * Hands out the next leaf node from the node pool.
+	*/
+
+	Node* node = &nodePool[nodePoolIndex++];
+	*node = Node(symbol, count);
+	return node;
+}
+
+Huffman::Node* Huffman::NewNode(Node* left, Node* right)
+{
+	/*
+	 * Hands out the next parent node from the node pool, with the children in tow.
+	*/
+
+	Node* node = &nodePool[nodePoolIndex++];
+	*node = Node(left, right);
+	return node;
+}
+
+void Huffman::AllocateBuffers()
+{
+	/*
+	 * Allocates the read/write buffers the first time they are needed. Every call after that just reuses them.
+	*/
+
+	if (inputBuffer != nullptr && outputBuffer != nullptr)
+		return;
+
+	// We HAVE to dynamically allocate these to avoid a stack overflow, they must be put onto the heap!!!
+	FreeBuffers();
+	bufferAlignment = bufferSize >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : CACHE_LINE_SIZE;
+	inputBuffer = (unsigned char*)operator new[](bufferSize + INPUT_BUFFER_SLACK, align_val_t(bufferAlignment));
+	outputBuffer = (unsigned char*)operator new[](bufferSize, align_val_t(bufferAlignment));
+}
+
+void Huffman::FreeBuffers()
+{
+	/*
+	 * Frees the read/write buffers (if they were ever allocated), using the same alignment they were allocated with.
+	*/
+
+	if (inputBuffer != nullptr)
+		operator delete[](inputBuffer, align_val_t(bufferAlignment));
+	if (outputBuffer != nullptr)
+		operator delete[](outputBuffer, align_val_t(bufferAlignment));
+	inputBuffer = nullptr;
+	outputBuffer = nullptr;
+}
+
+Huffman::Node* Huffman::BuildTree(istream& inputStream, ostream& outputStream, unsigned char rows[], bool sampled)
 {
 	/*
 	 * Builds the tree from the input file stream and outputs it to the output file stream.
+	 * With sampled set, the counts come from CalculateSampledCounts instead of the whole file.
 	*/
 
 	// Declare my return var and the temporary nodes array 
 	Node* root = nullptr;
 	Node* nodes[256];
 
-	// Pre-allocate the nodes array.
+	// Pre-allocate the nodes array, starting over with an empty node pool.
+	nodePoolIndex = 0;
 	for (int i = 0; i < 256; i++)
-		nodes[i] = new Node(i, 0);
+		nodes[i] = NewNode(i, 0);
 
 	// Build up the freq array
-	CalculateFrequencyCounts(inputStream, nodes);
+	if (sampled)
+		CalculateSampledCounts(inputStream, nodes);
+	else
+		CalculateFrequencyCounts(inputStream, nodes);
 
-	// Loop over the nodes, building not only the individual subtrees, but also saving the tree-building info
-	for (int i = 0, rowIndex = 0; i < 255; i++, rowIndex += 2)
-		BuildSubTree(nodes, rows, rowIndex);
+	// Build the individual subtrees, also saving the tree-building info
+	BuildSubTrees(nodes, rows);
 
 	// Find the root, it *might* be at index 0, if not, search the tree
 	root = nodes[0];
@@ -241,9 +749,10 @@ Huffman::Node* Huffman::BuildTree(unsigned char rows[])
 	Node* root = nullptr;
 	Node* nodes[256];
 
-	// Pre-allocate the nodes array.
+	// Pre-allocate the nodes array, starting over with an empty node pool.
+	nodePoolIndex = 0;
 	for (int i = 0; i < 256; i++)
-		nodes[i] = new Node((unsigned char)i, 0);
+		nodes[i] = NewNode((unsigned char)i, 0);
 
 	// Loop over the nodes building not only the individual subtrees
 	for (int i = 0, rowIndex = 0; i < 255; i++, rowIndex += 2)
@@ -260,7 +769,7 @@ Huffman::Node* Huffman::BuildTree(unsigned char rows[])
 	return root;
 }
 
-void Huffman::CalculateFrequencyCounts(ifstream& inputStream, Node* nodes[])
+void Huffman::CalculateFrequencyCounts(istream& inputStream, Node* nodes[])
 {
 	/*
 	 * Builds up an array of character frequences from an input file.
@@ -268,20 +777,100 @@ void Huffman::CalculateFrequencyCounts(ifstream& inputStream, Node* nodes[])
 
 	// This is where we get our first glimps into the file buffering. We will load the file in a rotating buffer
 
-	unsigned char* buffer = new unsigned char[READ_WRITE_BUFFER_SIZE]; // We HAVE to dynamically allocate this to avoid a stack overflow, it must be put onto the heap!!!
+	HUFFMAN_PROFILE_SCOPE(FREQUENCY_COUNTS);
+	AllocateBuffers();
+
+	// Four separate count tables, so runs of the same character don't keep stalling on the same counter. They're summed into the nodes at the end.
+	unsigned long long counts[4][256] = {}; // 64-bit, a 32-bit table wraps after 4GB of one character
 
 	while (!inputStream.eof()) // Keep looping until the end of file is reached
 	{
-		inputStream.read((char*)buffer, READ_WRITE_BUFFER_SIZE); // Read 'up to' the buffer size, the actual bytes read might be less
-		for (streamsize i = 0; i < inputStream.gcount(); i++) // Loop over however many bytes were read last by the inputStream
+		inputStream.read((char*)inputBuffer, bufferSize); // Read 'up to' the buffer size, the actual bytes read might be less
+		streamsize bytesRead = inputStream.gcount();
+		streamsize i = 0;
+		HUFFMAN_PROFILE_COUNT(FREQUENCY_COUNTS, bytesRead, 0);
+		for (; i + 4 <= bytesRead; i += 4) // Loop over however many bytes were read last by the inputStream, 4 at a time
 		{
-			unsigned char c = buffer[i]; // Get the next character in the buffer
-			nodes[c]->count++; // Increment the count of whatever character was read
+			counts[0][inputBuffer[i]]++;
+			counts[1][inputBuffer[i + 1]]++;
+			counts[2][inputBuffer[i + 2]]++;
+			counts[3][inputBuffer[i + 3]]++;
 		}
+		for (; i < bytesRead; i++) // Pick up the last few characters
+			counts[0][inputBuffer[i]]++;
 	}
 
-	// Free the mems
-	delete[] buffer;
+	// Increment the count of every character by however many times it was read
+	for (int c = 0; c < 256; c++)
+		nodes[c]->count += (long long)(counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c]);
+}
+
+long long Huffman::CalculateSampledCounts(istream& inputStream, Node* nodes[])
+{
+	/*
+	 * Builds up an estimate of the character frequencies from SAMPLE_CHUNK_COUNT chunks of SAMPLE_CHUNK_SIZE bytes, spread evenly from the start to the end of the input.
+	 * Every count is then bumped by one (Laplace smoothing), so a character that happens to miss the sample still gets a sane code length rather than one of the deepest.
+	 * Inputs no bigger than the sample are just counted in full, exactly. Returns how many bytes were read.
+	*/
+
+	// Find the size of the input
+	inputStream.clear();
+	inputStream.seekg(0, ios::end);
+	streamoff inputSize = inputStream.tellg();
+	inputStream.seekg(0, ios::beg);
+
+	long long sampleSize = (long long)SAMPLE_CHUNK_COUNT * SAMPLE_CHUNK_SIZE;
+	if (inputSize <= sampleSize)
+	{
+		CalculateFrequencyCounts(inputStream, nodes);
+		return inputSize > 0 ? (long long)inputSize : 0;
+	}
+
+	HUFFMAN_PROFILE_SCOPE(FREQUENCY_COUNTS);
+	AllocateBuffers();
+	long long counts[256] = {}; // 64-bit all the way through, like CalculateFrequencyCounts, even though a sample alone can't get near 2GB
+	long long bytesTotal = 0;
+
+	for (int chunk = 0; chunk < SAMPLE_CHUNK_COUNT; chunk++)
+	{
+		// The first chunk is at the very start, the last one ends at the very end
+		streamoff offset = (inputSize - (streamoff)SAMPLE_CHUNK_SIZE) * chunk / (SAMPLE_CHUNK_COUNT - 1);
+		inputStream.clear();
+		inputStream.seekg(offset, ios::beg);
+
+		// The chunk is read a buffer at a time, in case the buffers are smaller than a chunk
+		for (size_t chunkRead = 0; chunkRead < SAMPLE_CHUNK_SIZE;)
+		{
+			size_t bytesWanted = SAMPLE_CHUNK_SIZE - chunkRead < bufferSize ? SAMPLE_CHUNK_SIZE - chunkRead : bufferSize;
+			inputStream.read((char*)inputBuffer, bytesWanted);
+			size_t bytesRead = (size_t)inputStream.gcount();
+			HUFFMAN_PROFILE_COUNT(FREQUENCY_COUNTS, bytesRead, 0);
+			for (size_t i = 0; i < bytesRead; i++)
+				counts[inputBuffer[i]]++;
+
+			chunkRead += bytesRead;
+			bytesTotal += bytesRead;
+			if (bytesRead < bytesWanted)
+				break; // The input ran short, it must have shrunk since we measured it
+		}
+	}
+
+	for (int c = 0; c < 256; c++)
+		nodes[c]->count += counts[c] + 1LL;
+	return bytesTotal;
+}
+
+void Huffman::BuildSubTrees(Node* nodes[], unsigned char rows[])
+{
+	/*
+	 * Does all 255 merges that turn the 256 leaves into one tree, saving the tree-building info in the rows.
+	 * Profiled as a whole, a scope around each merge would cost more (in counter reads) than the merge itself.
+	 */
+
+	HUFFMAN_PROFILE_SCOPE(BUILD_SUBTREE);
+
+	for (int i = 0, rowIndex = 0; i < 255; i++, rowIndex += 2)
+		BuildSubTree(nodes, rows, rowIndex);
 }
 
 void Huffman::BuildSubTree(Node* nodes[], unsigned char rows[], int rowIndex)
@@ -290,8 +879,8 @@ void Huffman::BuildSubTree(Node* nodes[], unsigned char rows[], int rowIndex)
 	 * Finds the lowest and second lowest nodes, parents them to a new 'parent' node.
 	 */
 
-	int lowest = INT_MAX; // Lowest 'count' encountered in this pass
-	int secondLowest = INT_MAX; // Second lowest 'count' found in the pass
+	long long lowest = LLONG_MAX; // Lowest 'count' encountered in this pass
+	long long secondLowest = LLONG_MAX; // Second lowest 'count' found in the pass
 	int lowestIndex = -1; // The index where the lowest 'coun' was found
 	int secondLowestIndex = -1; // The index where the second lowest 'count' was found
 
@@ -328,7 +917,7 @@ void Huffman::BuildSubTree(Node* nodes[], unsigned char rows[], int rowIndex)
 	// Set the correct row info, create a new parent node, with the children in tow, null out the old spot of the right child.
 	rows[rowIndex] = leftIndex; // Set the row number to whatever the leftIndex was
 	rows[rowIndex + 1] = rightIndex; // Set the next row number to the rightIndex
-	nodes[leftIndex] = new Node(leftNode, rightNode); // Create a parent node, having the leftNode and rightNode as the left and right children
+	nodes[leftIndex] = NewNode(leftNode, rightNode); // Create a parent node, having the leftNode and rightNode as the left and right children
 	nodes[rightIndex] = nullptr; // Set the rightIndex to null, for the next pass
 }
 
@@ -342,7 +931,7 @@ void Huffman::BuildSubFromRows(Node* nodes[], unsigned char rows[], int rowIndex
 	int rightIndex = rows[rowIndex + 1]; // Gets the second index from the rowIndex + 1
 	Node* leftNode = nodes[leftIndex]; // left Index into the nodes array is the left child
 	Node* rightNode = nodes[rightIndex]; // Right index into the nodes array is the right child
-	nodes[leftIndex] = new Node(leftNode, rightNode); // Create a parent node and set the left and right children
+	nodes[leftIndex] = NewNode(leftNode, rightNode); // Create a parent node and set the left and right children
 	nodes[rightIndex] = nullptr; // Set the right nodes index to null, allows us to search for the root later
 }
 
@@ -379,286 +968,279 @@ void Huffman::TraverseAndBuild(Node* node, string bstring, string* bStrings)
 	}
 }
 
-void Huffman::EncodeAndWrite(ifstream& inputStream, ofstream& outputStream, string* bStrings)
+unsigned long long Huffman::EncodeAndWrite(istream& inputStream, ostream& outputStream, unsigned char partialByte, int partialBits)
 {
 	/*
-	 * Runs through the input file, converting the characters to their binary path equivilent (as per the tree), then outputs it all to a file (with buffering).
+	 * Runs through the input file, converting the characters to their binary path equivilent (as per the code tables), then outputs it all to a file (with buffering).
+	 * When appending, the first partialBits (the low bits of partialByte) are carried on from, they are written back out ahead of the new data.
+	 * Returns how many bits of encoded data were written, not counting the partial bits it started with or the zero padding on the last byte.
 	*/
 
 	// Reset the stream back to the beginning
 	inputStream.clear();
 	inputStream.seekg(0, ios::beg);
 
-	unsigned char* inputBuffer = new unsigned char[READ_WRITE_BUFFER_SIZE]; // Declare an input buffer used for reading in chunks of input data, MUST BE ALLOCATED ON HEAP!!
-	unsigned char* outputBuffer = new unsigned char[READ_WRITE_BUFFER_SIZE]; // So this buffer is only written when either full, or the entire inputfile has been read, MUST BE ALLOCATED ON HEAP!!
-	string binaryToCharBuffer; // Used for holding the 8 'bits' of each byte to be written to the larger output buffer
-	int outputBufferIndex = 0; // Output buffer index, keeping track of the buffer positioning
-	bool forceOutput = false; // When the end of the file is reached and the padding bits have been calculated, this bool will flip to true, to force the large output buffer to write to file
+	HUFFMAN_PROFILE_SCOPE(ENCODE);
+	AllocateBuffers(); // The input buffer is used for reading in chunks of input data, the output buffer is only written when it's (nearly) full, or the entire inputfile has been read
+	BitWriter writer = { partialByte, partialBits, outputBuffer, 0 };
+	unsigned long long bitCount = 0; // Total bits written, counted a buffer at a time
+	size_t limit = bufferSize - ENCODE_OUTPUT_MARGIN; // Once the output buffer index passes this, the kernels hand control back so the buffer can be dumped
 
 	/*
 	* Keep looping until the end of the input file is reached
 	* Each loop we do the following:
 	*	1. Read 'up to' the buffer size, the actual bytes read might be less
-	*	2. Loop over however many bytes were read last by the inputStream (gcount())
-	*	3. Get the next character in the inputBuffer
-	*	4. Find the correct binary string in our generated lookup table
-	*	5. Store those binary 'bits' from our lookup table into the binaryToCharBuffer 'string' in groupings of 8 'bits' each
-	*	6. Everytime we fill the smallOutputBuffer (8-bits), we convert that base-2 string into a base10 unsigned char and store that in the large outputBuffer
-	*	7. Once the larger ouputBuffer is filled, we dump that to the outputStream
-	*	8. At the very end we calculate padding bits if needed (see comments below).
+	*	2. Hand as much of the inputBuffer as possible to the AVX2 kernel (if the CPU has it), it works in groups of 8 characters
+	*	3. The codec's scalar kernel picks up whatever is left over (or everything, without AVX2)
+	*	4. Both kernels stop early once the outputBuffer is nearly full, we dump that to the outputStream and carry on
+	*	5. At the very end the last byte is padded out with zeros, the bit count tells the decoder where the real data stops
 	*/
 	while (!inputStream.eof())
 	{
-		inputStream.read((char*)inputBuffer, READ_WRITE_BUFFER_SIZE);
-		for (streamsize i = 0; i < inputStream.gcount(); i++)
+		inputStream.read((char*)inputBuffer, bufferSize);
+		size_t bytesRead = (size_t)inputStream.gcount();
+		size_t i = 0;
+		HUFFMAN_PROFILE_COUNT(ENCODE, bytesRead, bytesRead);
+
+		while (i < bytesRead)
 		{
-			unsigned char c = inputBuffer[i];
-			string bString = bStrings[c];
+			if (useAVX2)
+				i += EncodeChunkAVX2(inputBuffer + i, bytesRead - i, writer, limit);
+			i += codec.Encode(inputBuffer + i, bytesRead - i, writer, limit);
 
-			for (int j = 0; j < bString.length(); j++)
+			if (writer.index > limit)
 			{
-				binaryToCharBuffer.push_back(bString.c_str()[j]); // Yes, substr would be faster, but I want to maintain a count added between inner loops without added complexity
-
-				/*
-				 * If the end of the input file has been reached, and we have read the last input byte stored in the inputBuffer
-				 * AND we have already written the last bit from the binary string lookup table.
-				 * Then we will calculate the padding needed to make our last byte written out a total of 8-bits
-				 * And we will flip the forceOutputWrite flag, to force our outputBuffer to write to file whatever it has currently has.
-				*/
-				if (inputStream.eof() && i == inputStream.gcount() - 1 && j == bString.length() - 1)
-				{
-					forceOutput = true;
-
-					if (binaryToCharBuffer.length() < 8)
-					{
-						int paddingLength = 8 - binaryToCharBuffer.length(); // Calculate padding length
-						string padd = FindPaddingBits(bStrings, paddingLength); // Find the required padding bits
-						for (int k = 0; k < padd.length(); k++)
-						{
-							binaryToCharBuffer.push_back(padd.c_str()[k]); // 'Padd' the end of the last byte
-						}
-					}
-				}
-
-				/*
-				 * If the small output buffer is full we do a few things:
-					1. Convert the binaryToCharBuffer (which is all '1's and '0's to a unsigned char
-					2. Set that converted character into the main output buffer
-					3. If the larger output buffer is full, dump it to the output stream and reset it's index (head)
-				*/
-				if (binaryToCharBuffer.length() == 8)
-				{
-					// Convert the binaryToCharBuffer into an unsigned char
-					unsigned char outChar = 0;
-					for (int k = 0; k < 8; k++) // Loop over all the binary digits (there's only 8)
-						if (binaryToCharBuffer.c_str()[k] == '1')
-							outChar |= ((unsigned char)1 << (7 - k)); // Shift it and Or it into place
-
-					outputBuffer[outputBufferIndex] = outChar;
-					outputBufferIndex++;
-					binaryToCharBuffer.clear(); // Clear the small buffer in preperation for another byte
-
-					if (outputBufferIndex == READ_WRITE_BUFFER_SIZE || (forceOutput && outputBufferIndex > 0)) // Need the (forceOutput && outputBufferIndex > 0) to prevent special cases
-					{
-						outputStream.write((char*)outputBuffer, outputBufferIndex);
-						outputBufferIndex = 0;
-					}
-				}
+				outputStream.write((char*)outputBuffer, writer.index);
+				bitCount += writer.index * 8;
+				writer.index = 0;
 			}
 		}
 	}
+	bitCount += writer.index * 8 + writer.count - partialBits;
 
-	// Free the memory
-	delete[] outputBuffer;
-	delete[] inputBuffer;
+	// Pad the last byte (if it isn't full) and force the outputBuffer to write to file whatever it currently has
+	writer.Flush();
+	if (writer.index > 0)
+		outputStream.write((char*)outputBuffer, writer.index);
+
+	return bitCount;
 }
 
-void Huffman::DecodeAndWrite(ifstream& inputStream, ofstream& outputStream, Node* root)
+#ifdef HUFFMAN_X86
+TARGET_AVX2 size_t Huffman::EncodeChunkAVX2(const unsigned char* input, size_t count, BitWriter& writer, size_t limit)
 {
 	/*
-	 * Takes encoded input data from the inputStream, decodes it, and writes it out to the outputStream.
-	 */
+	 * AVX2 encode kernel. Works on groups of 8 characters at a time:
+	 *	1. Split the 8 characters into the 4 even and 4 odd ones, widened to 32-bit gather indices
+	 *	2. Gather the codes and lengths of all 8 out of the codec's tables
+	 *	3. Merge every even code with the odd code after it, (even << oddLength) | odd, giving 4 pair codes
+	 *	4. Merge the pairs the same way across lanes, (pair0 << pair1Length) | pair1, giving 2 codes of up to 4 * MAX_QUAD_CODE_LENGTH bits
+	 *	   (each code ends up shifted by the sum of the lengths after it, a prefix sum done as a two level tree)
+	 *	5. Write each of the 2 merged codes with one 64-bit store (PutWord), rather than a byte at a time
+	 * If any code in the group is longer than MAX_QUAD_CODE_LENGTH, that group is handed to the scalar kernel instead.
+	 * Stops at the last whole group, or once the output buffer index passes the limit, and returns how many input characters were consumed.
+	 * ENCODE_OUTPUT_MARGIN leaves more than enough room past the limit for PutWord's 8-byte stores.
+	*/
 
-	Node* current = root; // This 'current' node is what is used to step through the tree
-	unsigned char* inputBuffer = new unsigned char[READ_WRITE_BUFFER_SIZE]; // Declare an input buffer used for reading in chunks of input data, MUST BE ALLOCATED ON HEAP!!
-	unsigned char* outputBuffer = new unsigned char[READ_WRITE_BUFFER_SIZE]; // So this buffer is only written when either full, or the entire inputfile has been read, MUST BE ALLOCATED ON HEAP!!
-	int outputBufferIndex = 0; // Output buffer index, keeping track of the buffer positioning
-	bool forceOutput = false; // When the end of the file is reached and the padding bits have been calculated, this bool will flip to true, to force the large output buffer to write to file
+	const __m128i evenShuffle = _mm_setr_epi8(0, -1, -1, -1, 2, -1, -1, -1, 4, -1, -1, -1, 6, -1, -1, -1); // Moves bytes 0,2,4,6 into the bottom of each 32-bit lane
+	const __m128i oddShuffle = _mm_setr_epi8(1, -1, -1, -1, 3, -1, -1, -1, 5, -1, -1, -1, 7, -1, -1, -1); // Moves bytes 1,3,5,7 into the bottom of each 32-bit lane
+	const __m256i maxQuadLength = _mm256_set1_epi64x(MAX_QUAD_CODE_LENGTH);
+	const long long* codes = (const long long*)codec.tables.codes;
+	const int* lengths = (const int*)codec.tables.lengths;
 
-	/*
-	* Keep looping until the end of the input file is reached
-	* Each loop we do the following:
-	*	1. Read 'up to' the buffer size, the actual bytes read might be less
-	*	2. Loop over however many bytes were read last by the inputStream (gcount())
-	*	3. Get the next character in the inputBuffer
-	*	4. Then we use bitwise operation to split the data apart into it's indidvidual 'bits'
-	*	5. Use those binary 'bits' from our buffer to step through the tree
-	*	6. If the bit is '0', move to the left child; if '1', move to the right child
-	*	7. Once a leaf node is reached, store the symbol at that leaf node into our output buffer
-	*	8. Once the larger ouputBuffer is filled, we dump that to the outputStream
-	*/
-	while (!inputStream.eof())
+	BitWriter local = writer; // Work on a copy so it stays in registers
+	size_t i = 0;
+
+	for (; i + 8 <= count && local.index <= limit; i += 8)
 	{
-		inputStream.read((char*)inputBuffer, READ_WRITE_BUFFER_SIZE);
-		for (streamsize i = 0; i < inputStream.gcount(); i++)
+		__m128i group = _mm_loadl_epi64((const __m128i*)(input + i));
+		__m128i evenIndices = _mm_shuffle_epi8(group, evenShuffle);
+		__m128i oddIndices = _mm_shuffle_epi8(group, oddShuffle);
+
+		__m256i evenLengths = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(lengths, evenIndices, 4));
+		__m256i oddLengths = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(lengths, oddIndices, 4));
+		__m256i tooLong = _mm256_or_si256(_mm256_cmpgt_epi64(evenLengths, maxQuadLength), _mm256_cmpgt_epi64(oddLengths, maxQuadLength));
+		if (!_mm256_testz_si256(tooLong, tooLong))
 		{
-			unsigned int byte = inputBuffer[i];
-			int buffer[8]; // Declare and init a buffer to hold the byte data
-
-			// All of this is splitting the data out into it's individual bits
-			buffer[0] = (byte >> 7 & 1);
-			buffer[1] = (byte >> 6 & 1);
-			buffer[2] = (byte >> 5 & 1);
-			buffer[3] = (byte >> 4 & 1);
-			buffer[4] = (byte >> 3 & 1);
-			buffer[5] = (byte >> 2 & 1);
-			buffer[6] = (byte >> 1 & 1);
-			buffer[7] = (byte >> 0 & 1);
-
-			// Loop over the buffer
-			for (int j = 0; j < 8; j++)
-			{
-				if (inputStream.eof() && i == inputStream.gcount() - 1 && j == 7) // If the end of the file is reached, and we are moving out last bit into position, force and output write
-					forceOutput = true;
-
-				// If the bit is a 0, move to the left child
-				if (buffer[j] == 0)
-					current = current->left;
-				// If the bit is a 1, move to the right child
-				if (buffer[j] == 1)
-					current = current->right;
-				// If we have moved to a leaf node, grab the nodes symbol, write the outputBuffer, and reset the current node to the root
-				if (current->IsLeaf())
-				{
-					unsigned char symbol = current->symbol;
-					current = root;
-
-					outputBuffer[outputBufferIndex] = symbol; // Put the node symbol in the output buffer
-					outputBufferIndex++;
-				}
-
-				if (outputBufferIndex == READ_WRITE_BUFFER_SIZE || (forceOutput && outputBufferIndex > 0)) // Need the (forceOutput && outputBufferIndex > 0) to prevent special cases
-				{
-					outputStream.write((char*)outputBuffer, outputBufferIndex); // Write the data buffer to the output stream
-					outputBufferIndex = 0;
-				}
-			}
+			// At least one long code in here, let the scalar kernel deal with this group
+			codec.Encode(input + i, 8, local, SIZE_MAX);
+			continue;
 		}
+
+		__m256i evenCodes = _mm256_i32gather_epi64(codes, evenIndices, 8);
+		__m256i oddCodes = _mm256_i32gather_epi64(codes, oddIndices, 8);
+		__m256i pairCodes = _mm256_or_si256(_mm256_sllv_epi64(evenCodes, oddLengths), oddCodes);
+		__m256i pairLengths = _mm256_add_epi64(evenLengths, oddLengths);
+
+		// Lanes 1 and 3 copied down over lanes 0 and 2, so each even pair can be merged with the pair after it
+		__m256i nextCodes = _mm256_permute4x64_epi64(pairCodes, _MM_SHUFFLE(3, 3, 1, 1));
+		__m256i nextLengths = _mm256_permute4x64_epi64(pairLengths, _MM_SHUFFLE(3, 3, 1, 1));
+		__m256i quadCodes = _mm256_or_si256(_mm256_sllv_epi64(pairCodes, nextLengths), nextCodes);
+		__m256i quadLengths = _mm256_add_epi64(pairLengths, nextLengths);
+
+		local.PutWord((unsigned long long)_mm256_extract_epi64(quadCodes, 0), (int)_mm256_extract_epi64(quadLengths, 0));
+		local.PutWord((unsigned long long)_mm256_extract_epi64(quadCodes, 2), (int)_mm256_extract_epi64(quadLengths, 2));
 	}
 
-	// Free the memory
-	delete[] outputBuffer;
-	delete[] inputBuffer;
+	writer = local;
+	return i;
 }
-
-string Huffman::FindPaddingBits(string* bStrings, int paddingLength)
+#else
+size_t Huffman::EncodeChunkAVX2(const unsigned char* /*input*/, size_t /*count*/, BitWriter& /*writer*/, size_t /*limit*/)
 {
 	/*
-	 * Calculates a padding bit array to use.
-	 * If for whatever reason, it failes to find one, it will first fall back to the lookup tables
-	 * And then, if it still fails to find a proper solution, it will just pad with zeros and pray for mercy.
+	 * No AVX2 on this platform, useAVX2 is never set so this is never called. Consumes nothing.
 	*/
 
-	string longestBString;
-	for (int i = 0; i < 256; i++)
-		if (bStrings[i].length() > longestBString.length())
-			longestBString = bStrings[i];
-
-	if (paddingLength + 1 < longestBString.length())
-		return longestBString.substr(0, paddingLength); // We KNOW that for this htree, this path will lead nowhere.
+	return 0;
+}
+#endif
 
+bool Huffman::DecodeAndWrite(istream& inputStream, ostream& outputStream, unsigned long long bitCount)
+{
 	/*
-	 * The padding calculations will almost never reach this point, but if they do, I want to be safe.
-	 * The next hundred lines or so, are all pretty similiar. I have pre-generated lookup tables (generated from my own standalone program!)
-	 * What each if statement clock is doing is 4 things:
-	 *	1. The if statement first checks if the requested padding bit length is appropriate for it's own lookup table (there are 7 tables)
-	 *	2. Next we will run through a loop of ALL the possible values in the lookup table
-	 *	3. We will also run an inner loop of all the binaryStrings, comparing them with the current lookup table value, and if similar, we will flip a flag
-	 *	4. If the flag is STILL false (no match was foound, which is good!) then we return the current lookup table string.
-	*/
-	bool matchFound = false; // Will be set to true if a padding combination is found while searching the lookup tables
+	 * Takes bitCount bits of encoded input data (one block) from the inputStream, decodes it, and writes it out to the outputStream.
+	 * The codec's decode table handles every code up to DECODE_TABLE_BITS long in one lookup, longer codes step through the flat decode tree one bit at a time.
+	 * Decoding stops exactly at the last bit, so the padding bits are never even looked at.
+	 * Returns false, without decoding anything past the real data, if the stream holds fewer bytes than the bit count needs,
+	 * or the codes don't end exactly on the bit count (a code cut off by it would otherwise be finished from the padding).
+	 */
 
-	if (paddingLength == 1)
-	{
-		for (int i = 0; i < 2; i++) // Loop over pow(2,paddingLength)
-		{
-			for (int j = 0; j < 256; j++) // Loop over bStrings
-				if (st1b[i] == bStrings[j])
-					matchFound = true;
-			if (!matchFound) // If this padding sequence matchs NO bString, we have a winner
-				return st1b[i];
-		}
-	}
-	if (paddingLength == 2)
-	{
-		for (int i = 0; i < 4; i++)
-		{
-			for (int j = 0; j < 256; j++)
-				if (st2b[i] == bStrings[j])
-					matchFound = true;
-			if (!matchFound)
-				return st2b[i];
-		}
-	}
-	if (paddingLength == 3)
-	{
-		for (int i = 0; i < 8; i++)
-		{
-			for (int j = 0; j < 256; j++)
-				if (st3b[i] == bStrings[j])
-					matchFound = true;
-			if (!matchFound)
-				return st3b[i];
-		}
-	}
-	if (paddingLength == 4)
-	{
-		for (int i = 0; i < 16; i++)
-		{
-			for (int j = 0; j < 256; j++)
-				if (st4b[i] == bStrings[j])
-					matchFound = true;
-			if (!matchFound)
-				return st4b[i];
-		}
-	}
-	if (paddingLength == 5)
+	unsigned long long remainingBytes = bitCount / 8 + (bitCount % 8 != 0 ? 1 : 0); // How much of this block is still to be read, (bitCount + 7) / 8 would wrap on a damaged count
+	size_t paddingBits = (size_t)((8 - bitCount % 8) % 8); // Zero bits on the end of the last byte
+	size_t carriedBytes = 0; // Bytes left over at the end of the last inputBuffer, moved to the front of the next one
+	size_t carriedBits = 0; // How many bits of the first carried byte were already used
+	size_t outputBufferIndex = 0; // Output buffer index, keeping track of the buffer positioning
+	HUFFMAN_PROFILE_SCOPE(DECODE);
+
+	// The bit count comes straight from the file, so check it against what's really left of the stream before trusting it (a stream that can't seek is caught by the short read instead)
+	streampos dataPosition = inputStream.tellg();
+	if (dataPosition != streampos(-1))
 	{
-		for (int i = 0; i < 32; i++)
-		{
-			for (int j = 0; j < 256; j++)
-				if (st5b[i] == bStrings[j])
-					matchFound = true;
-			if (!matchFound)
-				return st5b[i];
-		}
+		inputStream.seekg(0, ios::end);
+		streamoff availableBytes = inputStream.tellg() - dataPosition;
+		inputStream.seekg(dataPosition);
+		if (availableBytes < 0 || (unsigned long long)availableBytes < remainingBytes)
+			return false;
 	}
-	if (paddingLength == 6)
+
+	AllocateBuffers();
+
+	// Long codes walk the codec's flat decode tree, it's a few hundred bytes in one place rather than a Node for every step
+	bool cutOff = false; // Set if a long code ran out of bits
+	auto walkTree = [this, &cutOff](BitReader& reader) -> int
 	{
-		for (int i = 0; i < 64; i++)
-		{
-			for (int j = 0; j < 256; j++)
-				if (st6b[i] == bStrings[j])
-					matchFound = true;
-			if (!matchFound)
-				return st6b[i];
-		}
-	}
-	if (paddingLength == 7)
+		int symbol = codec.WalkTree(reader);
+		if (symbol < 0)
+			cutOff = true;
+		return symbol;
+	};
+
+	/*
+	* Keep looping until the whole block has been read
+	* Each loop we do the following:
+	*	1. Read 'up to' the buffer size (or what's left of the block) in after the carried bytes, the actual bytes read might be less
+	*	2. Decode every code that starts before the last DECODE_LOOKAHEAD bytes, so no code can be cut off by the end of the buffer
+	*	3. Each time the outputBuffer is filled, we dump that to the outputStream
+	*	4. Carry the undecoded bytes over to the front of the inputBuffer for the next loop
+	* On the last loop, there's nothing left to wait for, so everything is decoded up to the exact last bit.
+	*/
+	while (true)
 	{
-		for (int i = 0; i < 128; i++)
+		size_t space = bufferSize - carriedBytes;
+		size_t bytesWanted = remainingBytes < space ? (size_t)remainingBytes : space;
+		inputStream.read((char*)inputBuffer + carriedBytes, bytesWanted);
+		size_t bytesRead = (size_t)inputStream.gcount();
+		remainingBytes -= bytesRead;
+		HUFFMAN_PROFILE_COUNT(DECODE, bytesRead, 0);
+
+		if (bytesRead < bytesWanted)
+			return false; // The file ended before the bit count said it would
+
+		size_t availableBytes = carriedBytes + bytesRead;
+		bool lastChunk = remainingBytes == 0;
+		for (size_t k = 0; k < INPUT_BUFFER_SLACK; k++) // The BitReader reads past the end, make sure it's reading zeros
+			inputBuffer[availableBytes + k] = 0;
+
+		size_t endBit = lastChunk ? availableBytes * 8 - paddingBits : availableBytes * 8; // remainingBytes was checked, so the last chunk holds the padded last byte
+		BitReader reader(inputBuffer, endBit);
+		reader.Skip(carriedBits);
+		size_t stopBit = lastChunk ? endBit : (availableBytes - DECODE_LOOKAHEAD) * 8;
+
+		while (true)
 		{
-			for (int j = 0; j < 256; j++)
-				if (st7b[i] == bStrings[j])
-					matchFound = true;
-			if (!matchFound)
-				return st7b[i];
+			size_t decoded = codec.Decode(reader, outputBuffer + outputBufferIndex, bufferSize - outputBufferIndex, stopBit, walkTree);
+			outputBufferIndex += decoded;
+			HUFFMAN_PROFILE_COUNT(DECODE, 0, decoded);
+			if (outputBufferIndex < bufferSize)
+				break; // Stopped before filling the buffer, so we're done with this chunk
+
+			outputStream.write((char*)outputBuffer, outputBufferIndex); // Write the data buffer to the output stream
+			outputBufferIndex = 0;
 		}
+
+		if (cutOff || (lastChunk && reader.Position() != endBit))
+			return false; // The last code runs past the bit count, same rule as FixedCodec::DecodeBlock
+		if (lastChunk)
+			break;
+
+		carriedBytes = availableBytes - reader.Position() / 8;
+		carriedBits = reader.Position() % 8;
+		memmove(inputBuffer, inputBuffer + reader.Position() / 8, carriedBytes);
 	}
 
-	// Backup option; This should never, ever, happen. Just pads with zeros.....ugh..
-	string result;
-	for (int i = 0; i < paddingLength; i++)
-		result += '0';
-	return result;
-}
\ No newline at end of file
+	if (outputBufferIndex > 0)
+		outputStream.write((char*)outputBuffer, outputBufferIndex);
+	return true;
+}
+
+void Huffman::WriteBlockMagic(ostream& outputStream)
+{
+	/*
+	 * Writes the marker that starts every block, holding the format version.
+	*/
+
+	outputStream.write((const char*)HuffmanCore::BLOCK_MAGIC, HuffmanCore::BLOCK_MAGIC_SIZE);
+}
+
+bool Huffman::ReadBlockMagic(istream& inputStream)
+{
+	/*
+	 * Reads the marker at the start of a block. Returns false if the file ends first, or it isn't the marker of this format version.
+	*/
+
+	unsigned char bytes[HuffmanCore::BLOCK_MAGIC_SIZE];
+	inputStream.read((char*)bytes, HuffmanCore::BLOCK_MAGIC_SIZE);
+	if (inputStream.gcount() != (streamsize)HuffmanCore::BLOCK_MAGIC_SIZE)
+		return false;
+	return memcmp(bytes, HuffmanCore::BLOCK_MAGIC, HuffmanCore::BLOCK_MAGIC_SIZE) == 0;
+}
+
+void Huffman::WriteBlockLength(ostream& outputStream, unsigned long long bitCount)
+{
+	/*
+	 * Writes the bit count of a block, least significant byte first, so the files are the same no matter what machine wrote them.
+	*/
+
+	unsigned char bytes[BLOCK_LENGTH_SIZE];
+	for (int i = 0; i < BLOCK_LENGTH_SIZE; i++)
+		bytes[i] = (unsigned char)(bitCount >> (8 * i));
+	outputStream.write((char*)bytes, BLOCK_LENGTH_SIZE);
+}
+
+bool Huffman::ReadBlockLength(istream& inputStream, unsigned long long& bitCount)
+{
+	/*
+	 * Reads the bit count of a block written by WriteBlockLength. Returns false if the file ends before all of it could be read.
+	*/
+
+	unsigned char bytes[BLOCK_LENGTH_SIZE];
+	inputStream.read((char*)bytes, BLOCK_LENGTH_SIZE);
+	if (inputStream.gcount() != BLOCK_LENGTH_SIZE)
+		return false;
+
+	bitCount = 0;
+	for (int i = 0; i < BLOCK_LENGTH_SIZE; i++)
+		bitCount |= (unsigned long long)bytes[i] << (8 * i);
+	return true;
+}
@@ -10,6 +10,8 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
+#include "HuffmanCore.h"
 
 using namespace std;
 
@@ -20,21 +22,55 @@ class Huffman
 	*/
 
 public:
-	void EncodeFile(string inputFilePath, string outputFilePath);
-	void DecodeFile(string inputFilePath, string outputFilePath);
-	void MakeTreeBuilder(string inputFilePath, string outputFilePath);
-	void EncodeFileWithTree(string inputFilePath, string outputFilePath, string treeFilePath);
+	Huffman(size_t memoryBudget = DEFAULT_MEMORY_BUDGET);
+	~Huffman();
+	Huffman(const Huffman&) = delete; // The instance owns its node pool and buffers, so copying is not allowed
+	Huffman& operator=(const Huffman&) = delete;
+
+	bool EncodeFile(string inputFilePath, string outputFilePath, bool sampled = false);
+	bool DecodeFile(string inputFilePath, string outputFilePath);
+	bool EncodeStream(istream& inputStream, ostream& outputStream, bool sampled = false);
+	bool DecodeStream(istream& inputStream, ostream& outputStream);
+	bool MakeTreeBuilder(string inputFilePath, string outputFilePath);
+	bool EncodeFileWithTree(string inputFilePath, string outputFilePath, string treeFilePath);
+	bool GenerateCodebook(string treeBuilderFilePath, string headerFilePath, string name);
+	bool AppendFile(string inputFilePath, string archiveFilePath, bool newBlock);
+	bool AppendStream(istream& inputStream, iostream& archiveStream, bool newBlock);
+	void AnalyzeFile(string inputFilePath);
 	void DisplayHelp();
+	void SetBufferSize(size_t size);
+	size_t GetBufferSize();
+
+	static const int BLOCK_LENGTH_SIZE = 8; // Every block is the marker (HuffmanCore::BLOCK_MAGIC), the 510 tree-builder bytes, then this many bytes holding the encoded bit count, then the encoded data
+	static const int TREE_BUILDER_SIZE = 510; // The tree-builder rows, two per merge. A whole .htree file, and part of every block header
+	static const int BLOCK_HEADER_SIZE = (int)HuffmanCore::BLOCK_MAGIC_SIZE + TREE_BUILDER_SIZE + BLOCK_LENGTH_SIZE; // Everything in a block before the encoded data
+	static const size_t DEFAULT_MEMORY_BUDGET = 16 * 1024 * 1024; // Default budget for the read/write buffers (two 8MB buffers)
+	static const size_t MIN_BUFFER_SIZE = 1024; // Smallest read/write buffer that will be allocated, no matter how small the budget is
+	static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024; // Buffers at least this big are rounded up to, and aligned on, huge page boundaries
+	static const size_t CACHE_LINE_SIZE = 64; // Smaller buffers are just aligned on cache lines
+	static const size_t INPUT_BUFFER_SLACK = 16; // Extra bytes on the end of the input buffer, so the BitReader can always read 8 bytes at a time
+	static const int SAMPLE_CHUNK_COUNT = 64; // A sampled tree (-es) is built from this many chunks, spread evenly across the input
+	static const size_t SAMPLE_CHUNK_SIZE = 64 * 1024; // Size of each sampled chunk, so at most 4MB is read to build a sampled tree
 
 private:
+	friend class HuffmanFuzzer; // The fuzz harness (HuffmanFuzz.h) checks the kernels, the codec and the Node tree directly
+
 	struct Node //Node structure
 	{
 		Node* left; // Left child node pointer
 		Node* right; // Right child node pointer
 		int symbol; // What symbol is in this node (yes, I know it's an integer)
-		int count; // The frequency count of the node
+		long long count; // The frequency count of the node (64-bit, inputs can be well over 2GB)
 
-		Node(int symbol, int count)
+		Node()
+		{
+			/* Default node constructor, only used when the node pool is allocated */
+			this->symbol = 0;
+			this->count = 0;
+			this->left = nullptr;
+			this->right = nullptr;
+		};
+		Node(int symbol, long long count)
 		{
 			/* Node constructor, only used in allocating begging node structure */
 			this->symbol = symbol;
@@ -54,13 +90,45 @@ private:
 		bool IsLeaf() { /* Is this node a leaf or not */return left == nullptr && right == nullptr; };
 	};
 
-	Node* BuildTree(ifstream &inputStream, ofstream &outputStream, unsigned char rows[]);
+	static const int MAX_FAST_CODE_LENGTH = 56; // Longest code that can be written in one go, longer codes are written 32 bits at a time
+	static const int DECODE_TABLE_BITS = 11; // Codes up to this long are decoded with one table lookup, longer ones walk the tree
+	static const int MAX_QUAD_CODE_LENGTH = 14; // Longest code the AVX2 kernel will merge, four of them have to fit in MAX_FAST_CODE_LENGTH
+	static const size_t ENCODE_OUTPUT_MARGIN = 8 * 32 + 8; // Worst case output of one group of 8 symbols (256-bit codes) plus the pending bits
+	static const size_t DECODE_LOOKAHEAD = 32 + 8; // Bytes that have to be left in the input buffer to be sure the next code (256 bits max) is all there, plus the BitReader overrun
+	typedef HuffmanCore::Codec<8, DECODE_TABLE_BITS, MAX_FAST_CODE_LENGTH> ByteCodec; // The only configuration we ship, byte symbols
+	static_assert(sizeof(ByteCodec::Tables::decodeTree) <= 2048, "The flat decode tree is meant to sit in L1 next to the decode table");
+	typedef HuffmanCore::BitWriter BitWriter;
+	typedef HuffmanCore::BitReader BitReader;
+
+	static const int NODE_POOL_SIZE = 511; // 256 leaves + 255 parent nodes, that's every node a tree can ever have
+
+	Node nodePool[NODE_POOL_SIZE]; // Every node of the current tree lives in here, no more new'ing (and leaking) nodes
+	int nodePoolIndex; // Index of the next free node in the pool
+	unsigned char* inputBuffer; // Reusable input buffer, allocated once and shared by every pass
+	unsigned char* outputBuffer; // Reusable output buffer, allocated once and shared by every pass
+	size_t bufferSize; // Size of each of the read/write buffers, calculated from the memory budget
+	size_t bufferAlignment; // Alignment the read/write buffers were allocated with, needed again when freeing them
+	string bStrings[256]; // Reusable table of the binary path strings to each of the 256 characters (only used for reporting)
+	ByteCodec codec; // Reusable code and decode tables of the current tree
+	bool useAVX2; // Set when the CPU supports AVX2, picks the vectorized encode kernel
+
+	Node* NewNode(int symbol, long long count);
+	Node* NewNode(Node* left, Node* right);
+	void AllocateBuffers();
+	void FreeBuffers();
+	Node* BuildTree(istream &inputStream, ostream &outputStream, unsigned char rows[], bool sampled = false);
 	Node* BuildTree(unsigned char rows[]);
-	void CalculateFrequencyCounts(ifstream& inputStream, Node *nodes[]);
+	void CalculateFrequencyCounts(istream& inputStream, Node *nodes[]);
+	long long CalculateSampledCounts(istream& inputStream, Node* nodes[]);
+	void BuildSubTrees(Node* nodes[], unsigned char rows[]);
 	void BuildSubTree(Node* nodes[], unsigned char rows[], int rowIndex);
 	void BuildSubFromRows(Node* nodes[], unsigned char rows[], int rowIndex);
 	void TraverseAndBuild(Node *node, string bstring, string* bStrings);
-	void EncodeAndWrite(ifstream& inputStream, ofstream& outputStream, string* bStrings);
-	void DecodeAndWrite(ifstream& inputStream, ofstream& outputStream, Node* root);
-	string FindPaddingBits(string* bStrings, int paddingLength);
+	unsigned long long EncodeAndWrite(istream& inputStream, ostream& outputStream, unsigned char partialByte = 0, int partialBits = 0);
+	size_t EncodeChunkAVX2(const unsigned char* input, size_t count, BitWriter& writer, size_t limit);
+	bool DecodeAndWrite(istream& inputStream, ostream& outputStream, unsigned long long bitCount);
+	void WriteBlockMagic(ostream& outputStream);
+	bool ReadBlockMagic(istream& inputStream);
+	void WriteBlockLength(ostream& outputStream, unsigned long long bitCount);
+	bool ReadBlockLength(istream& inputStream, unsigned long long& bitCount);
 };
\ No newline at end of file
@@ -0,0 +1,346 @@
+/*
+ * File Name: HuffmanAsync.cpp
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the implementation of the asynchronous Huffman API and its worker pool.
+*/
+
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include "HuffmanAsync.h"
+
+using namespace std;
+
+class MemoryBuffer : public streambuf
+{
+	/*
+	 * Read-only stream buffer straight over a block of memory, so buffers can be handed to the stream based encoder without copying them.
+	 * Seeking is supported, the encoder reads its input twice.
+	*/
+
+public:
+	MemoryBuffer(const unsigned char* data, size_t size)
+	{
+		/* MemoryBuffer constructor, the whole block is the get area */
+		char* begin = (char*)data;
+		setg(begin, begin, begin + size);
+	};
+
+protected:
+	pos_type seekoff(off_type offset, ios_base::seekdir direction, ios_base::openmode which) override
+	{
+		/* Moves the read position relative to the beginning, the current position or the end */
+		char* base = direction == ios_base::beg ? eback() : direction == ios_base::cur ? gptr() : egptr();
+		char* target = base + offset;
+		if (!(which & ios_base::in) || target < eback() || target > egptr())
+			return pos_type(off_type(-1));
+		setg(eback(), target, egptr());
+		return pos_type(target - eback());
+	};
+
+	pos_type seekpos(pos_type position, ios_base::openmode which) override
+	{
+		/* Moves the read position to an absolute position */
+		return seekoff(off_type(position), ios_base::beg, which);
+	};
+};
+
+HuffmanAsync::HuffmanAsync(int threadCount, size_t maxQueueDepth, size_t memoryBudget)
+{
+	/*
+	 * HuffmanAsync constructor. Starts threadCount workers (0 means one per hardware thread), each with a Huffman instance with memoryBudget for its buffers.
+	*/
+
+	this->maxQueueDepth = maxQueueDepth > 0 ? maxQueueDepth : 1;
+	activeJobs = 0;
+	stopping = false;
+
+	if (threadCount <= 0)
+		threadCount = (int)thread::hardware_concurrency();
+	if (threadCount <= 0)
+		threadCount = 1;
+
+	for (int i = 0; i < threadCount; i++)
+		workers.push_back(thread(&HuffmanAsync::WorkerLoop, this, memoryBudget));
+}
+
+HuffmanAsync::~HuffmanAsync()
+{
+	/*
+	 * HuffmanAsync destructor. Lets the workers finish everything that's queued, then joins them.
+	*/
+
+	{
+		lock_guard<mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueNotEmpty.notify_all();
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+future<bool> HuffmanAsync::EncodeFileAsync(string inputFilePath, string outputFilePath)
+{
+	/*
+	 * Queues a file encode, waiting for room in the queue if it's full. The future holds whether it worked.
+	*/
+
+	shared_ptr<promise<bool>> result = make_shared<promise<bool>>();
+	Submit([=](Huffman& huffman)
+	{
+		try
+		{
+			result->set_value(huffman.EncodeFile(inputFilePath, outputFilePath));
+		}
+		catch (...)
+		{
+			result->set_exception(current_exception()); // Rethrown by the future's get()
+		}
+	}, true);
+	return result->get_future();
+}
+
+future<bool> HuffmanAsync::DecodeFileAsync(string inputFilePath, string outputFilePath)
+{
+	/*
+	 * Queues a file decode, waiting for room in the queue if it's full. The future holds whether it worked.
+	*/
+
+	shared_ptr<promise<bool>> result = make_shared<promise<bool>>();
+	Submit([=](Huffman& huffman)
+	{
+		try
+		{
+			result->set_value(huffman.DecodeFile(inputFilePath, outputFilePath));
+		}
+		catch (...)
+		{
+			result->set_exception(current_exception()); // Rethrown by the future's get()
+		}
+	}, true);
+	return result->get_future();
+}
+
+future<HuffmanAsync::BufferResult> HuffmanAsync::EncodeBufferAsync(vector<unsigned char> input)
+{
+	/*
+	 * Queues a buffer encode, waiting for room in the queue if it's full. The future holds the encoded data.
+	*/
+
+	shared_ptr<promise<BufferResult>> result = make_shared<promise<BufferResult>>();
+	shared_ptr<vector<unsigned char>> data = make_shared<vector<unsigned char>>(move(input));
+	Submit([=](Huffman& huffman)
+	{
+		try
+		{
+			BufferResult bufferResult;
+			bufferResult.success = EncodeBuffer(huffman, *data, bufferResult.data);
+			result->set_value(move(bufferResult));
+		}
+		catch (...)
+		{
+			result->set_exception(current_exception()); // Rethrown by the future's get()
+		}
+	}, true);
+	return result->get_future();
+}
+
+future<HuffmanAsync::BufferResult> HuffmanAsync::DecodeBufferAsync(vector<unsigned char> input)
+{
+	/*
+	 * Queues a buffer decode, waiting for room in the queue if it's full. The future holds the decoded data.
+	*/
+
+	shared_ptr<promise<BufferResult>> result = make_shared<promise<BufferResult>>();
+	shared_ptr<vector<unsigned char>> data = make_shared<vector<unsigned char>>(move(input));
+	Submit([=](Huffman& huffman)
+	{
+		try
+		{
+			BufferResult bufferResult;
+			bufferResult.success = DecodeBuffer(huffman, *data, bufferResult.data);
+			result->set_value(move(bufferResult));
+		}
+		catch (...)
+		{
+			result->set_exception(current_exception()); // Rethrown by the future's get()
+		}
+	}, true);
+	return result->get_future();
+}
+
+bool HuffmanAsync::TryEncodeFile(string inputFilePath, string outputFilePath, FileCallback callback)
+{
+	/*
+	 * Queues a file encode if there's room, returns false (and drops it) if the queue is full. The callback runs on the worker thread.
+	*/
+
+	return Submit([=](Huffman& huffman) { callback(huffman.EncodeFile(inputFilePath, outputFilePath)); }, false);
+}
+
+bool HuffmanAsync::TryDecodeFile(string inputFilePath, string outputFilePath, FileCallback callback)
+{
+	/*
+	 * Queues a file decode if there's room, returns false (and drops it) if the queue is full. The callback runs on the worker thread.
+	*/
+
+	return Submit([=](Huffman& huffman) { callback(huffman.DecodeFile(inputFilePath, outputFilePath)); }, false);
+}
+
+bool HuffmanAsync::TryEncodeBuffer(vector<unsigned char> input, BufferCallback callback)
+{
+	/*
+	 * Queues a buffer encode if there's room, returns false (and drops it) if the queue is full. The callback runs on the worker thread.
+	*/
+
+	shared_ptr<vector<unsigned char>> data = make_shared<vector<unsigned char>>(move(input));
+	return Submit([=](Huffman& huffman)
+	{
+		BufferResult bufferResult;
+		bufferResult.success = EncodeBuffer(huffman, *data, bufferResult.data);
+		callback(bufferResult);
+	}, false);
+}
+
+bool HuffmanAsync::TryDecodeBuffer(vector<unsigned char> input, BufferCallback callback)
+{
+	/*
+	 * Queues a buffer decode if there's room, returns false (and drops it) if the queue is full. The callback runs on the worker thread.
+	*/
+
+	shared_ptr<vector<unsigned char>> data = make_shared<vector<unsigned char>>(move(input));
+	return Submit([=](Huffman& huffman)
+	{
+		BufferResult bufferResult;
+		bufferResult.success = DecodeBuffer(huffman, *data, bufferResult.data);
+		callback(bufferResult);
+	}, false);
+}
+
+bool HuffmanAsync::Submit(Job job, bool wait)
+{
+	/*
+	 * Queues any job to run on a worker. If the queue is full, either waits for room (wait) or returns false straight away.
+	 * An exception thrown out of the job is dropped by the worker (the futures hand theirs over before that), so a job should catch what it cares about.
+	*/
+
+	{
+		unique_lock<mutex> lock(queueMutex);
+		if (queue.size() >= maxQueueDepth)
+		{
+			if (!wait)
+				return false;
+			queueNotFull.wait(lock, [this] { return queue.size() < maxQueueDepth; });
+		}
+
+		queue.push_back(move(job));
+		activeJobs++;
+	}
+
+	queueNotEmpty.notify_one();
+	return true;
+}
+
+void HuffmanAsync::WaitAll()
+{
+	/*
+	 * Blocks until every job submitted so far has finished.
+	*/
+
+	unique_lock<mutex> lock(queueMutex);
+	allDone.wait(lock, [this] { return activeJobs == 0; });
+}
+
+int HuffmanAsync::GetThreadCount()
+{
+	/*
+	 * Returns how many workers are in the pool.
+	*/
+
+	return (int)workers.size();
+}
+
+void HuffmanAsync::WorkerLoop(size_t memoryBudget)
+{
+	/*
+	 * Body of each worker thread. Takes jobs off the queue until it's empty and we're stopping.
+	 * The Huffman instance lives as long as the thread, so its buffers and tables are reused by every job it runs.
+	 * A job that throws doesn't take the thread down with it, and is counted as finished either way.
+	*/
+
+	struct JobDone // Counts the job as finished when it goes out of scope, however the job ended, so WaitAll can't hang on a job that threw
+	{
+		HuffmanAsync* pool; // The pool the job was running on
+
+		~JobDone()
+		{
+			/* JobDone destructor, takes the job off the active count and wakes WaitAll if it was the last */
+			lock_guard<mutex> lock(pool->queueMutex);
+			pool->activeJobs--;
+			if (pool->activeJobs == 0)
+				pool->allDone.notify_all();
+		};
+	};
+
+	Huffman huffman(memoryBudget);
+
+	while (true)
+	{
+		Job job;
+		{
+			unique_lock<mutex> lock(queueMutex);
+			queueNotEmpty.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return; // Stopping, and nothing left to do
+
+			job = move(queue.front());
+			queue.pop_front();
+		}
+		queueNotFull.notify_one();
+
+		JobDone done = { this };
+		try
+		{
+			job(huffman);
+		}
+		catch (...)
+		{
+			// Nowhere to send it (a callback or a plain Submit job threw), the futures already got theirs. Keep the worker going.
+		}
+	}
+}
+
+bool HuffmanAsync::EncodeBuffer(Huffman& huffman, const vector<unsigned char>& input, vector<unsigned char>& output)
+{
+	/*
+	 * Encodes a buffer into another, reading the input in place.
+	*/
+
+	MemoryBuffer inputBuffer(input.data(), input.size());
+	istream inputStream(&inputBuffer);
+	stringstream outputStream(ios::in | ios::out | ios::binary);
+
+	bool success = huffman.EncodeStream(inputStream, outputStream);
+	string encoded = outputStream.str();
+	output.assign(encoded.begin(), encoded.end());
+	return success;
+}
+
+bool HuffmanAsync::DecodeBuffer(Huffman& huffman, const vector<unsigned char>& input, vector<unsigned char>& output)
+{
+	/*
+	 * Decodes a buffer into another, reading the input in place.
+	*/
+
+	MemoryBuffer inputBuffer(input.data(), input.size());
+	istream inputStream(&inputBuffer);
+	ostringstream outputStream(ios::out | ios::binary);
+
+	bool success = huffman.DecodeStream(inputStream, outputStream);
+	string decoded = outputStream.str();
+	output.assign(decoded.begin(), decoded.end());
+	return success;
+}
@@ -0,0 +1,76 @@
+/*
+ * File Name: HuffmanAsync.h
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the definitions of the asynchronous Huffman API; a worker pool with a bounded queue that encodes and decodes files and buffers.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "Huffman.h"
+
+using namespace std;
+
+class HuffmanAsync
+{
+	/*
+	 * HuffmanAsync class. Runs encodes and decodes on a pool of worker threads, each with its own Huffman instance (and so its own node pool and buffers).
+	 * Every call returns straight away with a future, or calls back on the worker thread once it's done.
+	 * The queue is bounded; the blocking calls wait for room, the Try calls return false instead so an event loop never stalls.
+	*/
+
+public:
+	struct BufferResult // The result of a buffer encode/decode
+	{
+		bool success; // False if the input couldn't be decoded
+		vector<unsigned char> data; // The encoded/decoded output
+	};
+
+	typedef function<void(bool success)> FileCallback;
+	typedef function<void(BufferResult& result)> BufferCallback;
+	typedef function<void(Huffman& huffman)> Job; // A job gets the Huffman instance of the worker it's running on
+
+	HuffmanAsync(int threadCount = 0, size_t maxQueueDepth = DEFAULT_QUEUE_DEPTH, size_t memoryBudget = DEFAULT_WORKER_MEMORY_BUDGET);
+	~HuffmanAsync();
+	HuffmanAsync(const HuffmanAsync&) = delete; // The pool owns its threads, so copying is not allowed
+	HuffmanAsync& operator=(const HuffmanAsync&) = delete;
+
+	future<bool> EncodeFileAsync(string inputFilePath, string outputFilePath);
+	future<bool> DecodeFileAsync(string inputFilePath, string outputFilePath);
+	future<BufferResult> EncodeBufferAsync(vector<unsigned char> input);
+	future<BufferResult> DecodeBufferAsync(vector<unsigned char> input);
+	bool TryEncodeFile(string inputFilePath, string outputFilePath, FileCallback callback);
+	bool TryDecodeFile(string inputFilePath, string outputFilePath, FileCallback callback);
+	bool TryEncodeBuffer(vector<unsigned char> input, BufferCallback callback);
+	bool TryDecodeBuffer(vector<unsigned char> input, BufferCallback callback);
+	bool Submit(Job job, bool wait);
+	void WaitAll();
+	int GetThreadCount();
+
+	static const size_t DEFAULT_QUEUE_DEPTH = 64; // Jobs that can be waiting before the submitters get pushed back on
+	static const size_t DEFAULT_WORKER_MEMORY_BUDGET = 2 * 256 * 1024; // Each worker gets two 256KB buffers, small jobs don't need more
+
+private:
+	vector<thread> workers; // The worker threads
+	deque<Job> queue; // Jobs waiting for a worker
+	size_t maxQueueDepth; // Most jobs that can be waiting at once
+	size_t activeJobs; // Jobs that are queued or running, WaitAll waits for this to hit zero
+	bool stopping; // Set by the destructor, the workers finish the queue and exit
+	mutex queueMutex; // Guards everything above
+	condition_variable queueNotEmpty; // Signalled when a job is queued (or we're stopping)
+	condition_variable queueNotFull; // Signalled when a job is taken off the queue
+	condition_variable allDone; // Signalled when activeJobs hits zero
+
+	void WorkerLoop(size_t memoryBudget);
+	static bool EncodeBuffer(Huffman& huffman, const vector<unsigned char>& input, vector<unsigned char>& output);
+	static bool DecodeBuffer(Huffman& huffman, const vector<unsigned char>& input, vector<unsigned char>& output);
+};
@@ -0,0 +1,510 @@
+/*
+ * File Name: HuffmanCore.h
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the header-only codec core; the bit reader/writer, the table builder and the codec itself.
+ * Everything is templated on the decode table bits and the longest code that can be written in one go, so the compiler can specialize
+ * and inline the hot loops for each configuration we ship. The symbols are always bytes, SymbolBits only exists to be checked (it has to be 8).
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+
+namespace HuffmanCore
+{
+	struct MaskTable // Compile-time generated table of low bit masks, LOW_BITS.masks[n] has the lowest n bits set
+	{
+		unsigned long long masks[65];
+
+		constexpr MaskTable() : masks()
+		{
+			/* Generates all 65 masks, 0 through 64 bits */
+			for (int i = 0; i < 64; i++)
+				masks[i] = (1ULL << i) - 1;
+			masks[64] = ~0ULL;
+		};
+	};
+
+	constexpr MaskTable LOW_BITS = MaskTable();
+
+	constexpr unsigned char BLOCK_MAGIC[4] = { 'H', 'u', 'f', 1 }; // Every .huf block starts with this, the last byte is the format version. Files from before it have no marker and are rejected
+	constexpr size_t BLOCK_MAGIC_SIZE = sizeof(BLOCK_MAGIC);
+
+	struct BitWriter // Packs variable length codes, most significant bit first, into an output buffer
+	{
+		unsigned long long bits; // Pending bits that haven't made up a whole byte yet (only the lowest 'count' bits matter)
+		int count; // How many pending bits there are, always less than 8 between writes
+		unsigned char* output; // The buffer the whole bytes are written into
+		size_t index; // Where the next whole byte goes in the output buffer
+
+		inline void Put(unsigned long long code, int length)
+		{
+			/* Shifts a code of up to 56 bits into the pending bits, and moves every whole byte out to the output */
+			bits = (bits << length) | code;
+			count += length;
+			while (count >= 8)
+			{
+				count -= 8;
+				output[index++] = (unsigned char)(bits >> count);
+			}
+		};
+
+		inline void PutWord(unsigned long long code, int length)
+		{
+			/*
+			 * Same as Put, for a code of up to 56 bits, but moves every whole byte out with one 8-byte big-endian store instead of a byte at a time.
+			 * The output MUST have 8 writable bytes at index, the bytes past the whole ones are overwritten by the next write.
+			*/
+			bits = (bits << length) | code;
+			count += length;
+			unsigned long long word = bits << (64 - count); // count is at least 1 here, every code is
+			unsigned char* p = output + index;
+			p[0] = (unsigned char)(word >> 56); p[1] = (unsigned char)(word >> 48); p[2] = (unsigned char)(word >> 40); p[3] = (unsigned char)(word >> 32);
+			p[4] = (unsigned char)(word >> 24); p[5] = (unsigned char)(word >> 16); p[6] = (unsigned char)(word >> 8); p[7] = (unsigned char)word;
+			index += count >> 3;
+			count &= 7;
+		};
+
+		inline void Flush()
+		{
+			/* Writes out the last partial byte (if any), the unused low bits are left as zeros */
+			if (count > 0)
+				output[index++] = (unsigned char)((bits & LOW_BITS.masks[count]) << (8 - count));
+			count = 0;
+		};
+	};
+
+	class BitReader // Reads bits, most significant bit first, out of a buffer. The buffer MUST have 8 readable bytes past the end of the data!
+	{
+	public:
+		BitReader(const unsigned char* data, size_t bitLength)
+		{
+			/* BitReader constructor, starts at the first bit of the data */
+			this->data = data;
+			this->position = 0;
+			this->bitLength = bitLength;
+		};
+
+		inline unsigned long long Peek(int count) const
+		{
+			/* Returns the next 'count' bits (1 to 57) without moving past them. Anything past the end of the data is garbage, so check Remaining() */
+			const unsigned char* p = data + (position >> 3);
+			unsigned long long word = (unsigned long long)p[0] << 56 | (unsigned long long)p[1] << 48 | (unsigned long long)p[2] << 40 | (unsigned long long)p[3] << 32
+				| (unsigned long long)p[4] << 24 | (unsigned long long)p[5] << 16 | (unsigned long long)p[6] << 8 | (unsigned long long)p[7];
+			return (word << (position & 7)) >> (64 - count);
+		};
+
+		inline void Skip(size_t count) { /* Moves past 'count' bits */ position += count; };
+		inline size_t Position() const { /* How many bits have been read */ return position; };
+		inline size_t Remaining() const { /* How many bits are left */ return position < bitLength ? bitLength - position : 0; };
+
+	private:
+		const unsigned char* data; // The data being read
+		size_t position; // The bit position of the next bit
+		size_t bitLength; // Total number of bits in the data
+	};
+
+	struct DecodeEntry // One entry of the decode table
+	{
+		unsigned short symbol; // The symbol the code decodes to, or when the code is longer than the table, the flat decode tree node those first bits lead to
+		unsigned char length; // Length of the code, 0 means the code is longer than the table (walk the tree instead)
+	};
+
+	template <int SymbolBits, int TableBits, int MaxCodeLength>
+	struct CodeTables // Every table the codec needs, built from the tree-builder rows by TableBuilder
+	{
+		// Bytes only. The encoder indexes the tables with the raw input byte, so a narrower alphabet would read out of bounds, and longCodes here and the
+		// path scratch in TableBuilder::Build (on the stack, it has to be constexpr) grow with the square of the symbol count, so wider would need megabytes.
+		static_assert(SymbolBits == 8, "Only byte symbols are supported");
+		static_assert(TableBits >= 1 && TableBits <= 16, "The decode table has to be a sane size");
+		static_assert(MaxCodeLength >= TableBits && MaxCodeLength <= 56, "BitWriter::Put only takes codes of up to 56 bits");
+
+		typedef unsigned char Symbol; // The type of one input symbol (and of one tree-builder row)
+		static constexpr int SYMBOL_BITS = SymbolBits; // The template parameters again, so code holding just the tables can get at them
+		static constexpr int TABLE_BITS = TableBits;
+		static constexpr int MAX_CODE_LENGTH = MaxCodeLength;
+		static constexpr int SYMBOL_COUNT = 1 << SymbolBits; // Every symbol is in the tree, used or not
+		static constexpr int ROW_COUNT = 2 * (SYMBOL_COUNT - 1); // Two rows per merge, one merge per parent node
+		static constexpr int MAX_TREE_DEPTH = SYMBOL_COUNT - 1; // The deepest a leaf can ever be (a completely lopsided tree)
+		static constexpr int LONG_CODE_WORDS = (MAX_TREE_DEPTH + 31) / 32; // 32-bit words needed to hold the longest possible code
+
+		typedef unsigned short TreeEntry; // One child link of the flat decode tree
+		static constexpr TreeEntry LEAF_FLAG = (TreeEntry)((TreeEntry)1 << (sizeof(TreeEntry) * 8 - 1)); // Set on a child link that's a leaf, the rest of it is the symbol
+
+		unsigned long long codes[SYMBOL_COUNT]; // The code of each symbol, only valid for codes no longer than MaxCodeLength
+		unsigned int lengths[SYMBOL_COUNT]; // The length of each code in bits
+		unsigned int longCodes[SYMBOL_COUNT][LONG_CODE_WORDS]; // Every code split into 32-bit words, first bit in the top of the first word. Used for codes longer than MaxCodeLength
+		DecodeEntry decodeTable[1 << TableBits]; // Indexed by the next TableBits bits of input, gives the symbol and code length for every code up to TableBits long
+		TreeEntry decodeTree[SYMBOL_COUNT - 1][2]; // The tree as one flat array of parent nodes, breadth first from the root at 0. [0] is the left ('0') child and [1] the right, each either the index of another parent or LEAF_FLAG | symbol
+
+		constexpr CodeTables() : codes(), lengths(), longCodes(), decodeTable(), decodeTree() {};
+	};
+
+	template <int SymbolBits, int TableBits, int MaxCodeLength>
+	struct TableBuilder
+	{
+		typedef CodeTables<SymbolBits, TableBits, MaxCodeLength> Tables;
+
+		static constexpr bool Build(const typename Tables::Symbol rows[], Tables& tables)
+		{
+			/*
+			 * Builds the code and decode tables from the tree-builder rows, returns false if the rows don't describe a valid tree.
+			 * It's all constexpr, so for a tree that's known ahead of time the tables can be built by the compiler.
+			 *	1. Replay the merges from the rows, the same way BuildSubFromRows does, giving every parent node an id after the leaves
+			 *	2. Walk down the finished tree (left is a '0', right is a '1'), writing the code of each leaf as we go
+			 *	3. Fill every decode table entry that starts with a code of up to TableBits bits
+			 *	4. Lay the parent nodes out breadth first in the flat decode tree, for the codes too long for the table
+			*/
+
+			const int symbolCount = Tables::SYMBOL_COUNT;
+			const int nodeCount = 2 * symbolCount - 1;
+			int slots[Tables::SYMBOL_COUNT] = {}; // The node currently sitting at each index, -1 once it's been merged into a parent
+			int left[2 * Tables::SYMBOL_COUNT - 1] = {}; // Left child of each parent node
+			int right[2 * Tables::SYMBOL_COUNT - 1] = {}; // Right child of each parent node
+
+			for (int i = 0; i < symbolCount; i++)
+				slots[i] = i;
+
+			for (int i = 0; i < symbolCount - 1; i++)
+			{
+				int leftIndex = rows[2 * i];
+				int rightIndex = rows[2 * i + 1];
+				if (leftIndex >= symbolCount || rightIndex >= symbolCount || leftIndex == rightIndex || slots[leftIndex] < 0 || slots[rightIndex] < 0)
+					return false; // Merging a node that doesn't exist anymore, this isn't a tree
+
+				int parent = symbolCount + i;
+				left[parent] = slots[leftIndex];
+				right[parent] = slots[rightIndex];
+				slots[leftIndex] = parent;
+				slots[rightIndex] = -1;
+			}
+
+			// The last merge made the root. Walk down from it with an explicit stack, keeping the code (as words) and depth of each node on the way.
+			int stack[2 * Tables::SYMBOL_COUNT - 1] = {};
+			int depths[2 * Tables::SYMBOL_COUNT - 1] = {};
+			unsigned int paths[2 * Tables::SYMBOL_COUNT - 1][Tables::LONG_CODE_WORDS] = {};
+			int stackSize = 0;
+			stack[stackSize++] = nodeCount - 1;
+
+			while (stackSize > 0)
+			{
+				int node = stack[--stackSize];
+				if (node < symbolCount)
+				{
+					// A leaf, save its code
+					tables.lengths[node] = depths[node];
+					tables.codes[node] = 0;
+					for (int w = 0; w < Tables::LONG_CODE_WORDS; w++)
+						tables.longCodes[node][w] = paths[node][w];
+					if (depths[node] <= MaxCodeLength)
+						for (int b = 0; b < depths[node]; b++)
+							tables.codes[node] = (tables.codes[node] << 1) | ((paths[node][b / 32] >> (31 - b % 32)) & 1);
+					continue;
+				}
+
+				// A parent, its children are one deeper, with a '0' (left) or '1' (right) on the end of the path
+				int children[2] = { left[node], right[node] };
+				for (int c = 0; c < 2; c++)
+				{
+					int child = children[c];
+					depths[child] = depths[node] + 1;
+					for (int w = 0; w < Tables::LONG_CODE_WORDS; w++)
+						paths[child][w] = paths[node][w];
+					if (c == 1)
+						paths[child][depths[node] / 32] |= 1u << (31 - depths[node] % 32);
+					stack[stackSize++] = child;
+				}
+			}
+
+			// Every code that fits in the table fills all the entries that start with it
+			for (int i = 0; i < (1 << TableBits); i++)
+				tables.decodeTable[i] = DecodeEntry{ 0, 0 };
+			for (int s = 0; s < symbolCount; s++)
+			{
+				int length = (int)tables.lengths[s];
+				if (length > TableBits)
+					continue;
+
+				int first = (int)(tables.codes[s] << (TableBits - length));
+				for (int i = 0; i < (1 << (TableBits - length)); i++)
+					tables.decodeTable[first + i] = DecodeEntry{ (unsigned short)s, (unsigned char)length };
+			}
+
+			// Breadth first from the root, numbering each parent as it's queued so its children can point at it
+			int queue[Tables::SYMBOL_COUNT - 1] = {};
+			int flatIndex[2 * Tables::SYMBOL_COUNT - 1] = {};
+			int head = 0;
+			int tail = 0;
+			queue[tail] = nodeCount - 1;
+			flatIndex[nodeCount - 1] = tail++;
+
+			while (head < tail)
+			{
+				int node = queue[head++];
+				int children[2] = { left[node], right[node] };
+				for (int c = 0; c < 2; c++)
+				{
+					int child = children[c];
+					if (child < symbolCount)
+					{
+						tables.decodeTree[flatIndex[node]][c] = (typename Tables::TreeEntry)(Tables::LEAF_FLAG | child);
+						continue;
+					}
+
+					queue[tail] = child;
+					flatIndex[child] = tail++;
+					tables.decodeTree[flatIndex[node]][c] = (typename Tables::TreeEntry)flatIndex[child];
+				}
+			}
+
+			// The table entries of the long codes remember where their first TableBits bits lead, so the walk can start from there
+			for (int i = 0; i < (1 << TableBits); i++)
+			{
+				if (tables.decodeTable[i].length != 0)
+					continue;
+
+				typename Tables::TreeEntry entry = 0;
+				for (int b = TableBits - 1; b >= 0; b--)
+					entry = tables.decodeTree[entry][(i >> b) & 1];
+				tables.decodeTable[i].symbol = (unsigned short)entry;
+			}
+
+			return true;
+		};
+
+		static constexpr Tables Make(const typename Tables::Symbol rows[])
+		{
+			/*
+			 * Builds and returns the tables for a tree that's known ahead of time, e.g. static constexpr Tables TABLES = Make(ROWS);
+			 * Invalid rows hit the throw, which stops the compile when this is evaluated by the compiler.
+			*/
+
+			Tables tables;
+			if (!Build(rows, tables))
+				throw "The tree-builder rows don't describe a valid tree";
+			return tables;
+		};
+	};
+
+	template <int SymbolBits, int TableBits, int MaxCodeLength>
+	class Codec // Table driven encoder/decoder for one tree
+	{
+	public:
+		typedef CodeTables<SymbolBits, TableBits, MaxCodeLength> Tables;
+		typedef typename Tables::Symbol Symbol;
+
+		Tables tables; // The code and decode tables of the current tree
+
+		constexpr bool Build(const Symbol rows[])
+		{
+			/* (Re)builds the tables for the tree in the rows, returns false if the rows aren't a valid tree */
+			return TableBuilder<SymbolBits, TableBits, MaxCodeLength>::Build(rows, tables);
+		};
+
+		inline void PutLong(BitWriter& writer, Symbol symbol) const { /* Writes a code too long for BitWriter::Put, with the current tree */ PutLongWith(tables, writer, symbol); };
+
+		inline size_t Encode(const Symbol* input, size_t count, BitWriter& writer, size_t limit) const
+		{
+			/* Encodes symbols with the current tree, see EncodeWith */
+			return EncodeWith(tables, input, count, writer, limit);
+		};
+
+		template <typename LongCodeDecoder>
+		inline size_t Decode(BitReader& reader, Symbol* output, size_t capacity, size_t stopBit, LongCodeDecoder&& longCodeDecoder) const
+		{
+			/* Decodes symbols with the current tree, see DecodeWith */
+			return DecodeWith(tables, reader, output, capacity, stopBit, longCodeDecoder);
+		};
+
+		inline int WalkTree(BitReader& reader) const { /* Decodes one code by walking the current tree, see WalkTreeWith */ return WalkTreeWith(tables, reader); };
+
+		static inline int WalkTreeWith(const Tables& tables, BitReader& reader)
+		{
+			/*
+			 * Decodes one code a bit at a time through the flat decode tree, '0' to the left child and '1' to the right, until a leaf is reached.
+			 * This is the fallback for codes longer than the decode table. Returns the symbol, or -1 if it runs out of bits first (a damaged file).
+			 * The first TableBits bits are skipped in one go, the decode table entry for them says which node they lead to.
+			 * After that the bits are peeked 32 at a time, so each step is just a shift and one lookup in the (L1 sized) tree.
+			*/
+
+			typename Tables::TreeEntry entry = 0;
+			if (reader.Remaining() >= (size_t)TableBits)
+			{
+				entry = (typename Tables::TreeEntry)tables.decodeTable[reader.Peek(TableBits)].symbol;
+				reader.Skip(TableBits);
+			}
+
+			while (reader.Remaining() > 0)
+			{
+				int count = reader.Remaining() < 32 ? (int)reader.Remaining() : 32;
+				unsigned long long bits = reader.Peek(count);
+				for (int i = count - 1; i >= 0; i--)
+				{
+					entry = tables.decodeTree[entry][(bits >> i) & 1];
+					if (entry & Tables::LEAF_FLAG)
+					{
+						reader.Skip(count - i);
+						return (int)(entry & ~Tables::LEAF_FLAG);
+					}
+				}
+				reader.Skip(count);
+			}
+
+			return -1;
+		};
+
+		static inline void PutLongWith(const Tables& tables, BitWriter& writer, Symbol symbol)
+		{
+			/* Writes a code too long for BitWriter::Put, 32 bits at a time */
+			int length = (int)tables.lengths[symbol];
+			int w = 0;
+			for (; length >= 32; length -= 32, w++)
+				writer.Put(tables.longCodes[symbol][w], 32);
+			if (length > 0)
+				writer.Put(tables.longCodes[symbol][w] >> (32 - length), length);
+		};
+
+		static size_t EncodeWith(const Tables& tables, const Symbol* input, size_t count, BitWriter& writer, size_t limit)
+		{
+			/*
+			 * Encodes symbols one at a time until the input runs out or the output index passes the limit. Returns how many symbols were consumed.
+			 * Works on a copy of the writer so the compiler can keep it in registers, the output writes can't alias it.
+			 * The tables are a parameter so the same loop serves the rebuilt tables of a Codec and the compiled-in tables of a FixedCodec.
+			*/
+
+			BitWriter local = writer;
+			size_t i = 0;
+
+			for (; i < count && local.index <= limit; i++)
+			{
+				Symbol s = input[i];
+				if (tables.lengths[s] <= (unsigned int)MaxCodeLength)
+					local.Put(tables.codes[s], (int)tables.lengths[s]);
+				else
+					PutLongWith(tables, local, s);
+			}
+
+			writer = local;
+			return i;
+		};
+
+		template <typename LongCodeDecoder>
+		static size_t DecodeWith(const Tables& tables, BitReader& reader, Symbol* output, size_t capacity, size_t stopBit, LongCodeDecoder&& longCodeDecoder)
+		{
+			/*
+			 * Decodes symbols until the output is full or the next code starts at or past stopBit.
+			 * Every code that starts before stopBit has to be all there, the caller makes sure of that, so there are no end checks in here.
+			 * Codes longer than TableBits are handed to longCodeDecoder(reader), which returns the symbol, or -1 if it ran out of bits (a damaged file).
+			 * Returns how many symbols were decoded.
+			*/
+
+			size_t count = 0;
+			while (count < capacity && reader.Position() < stopBit)
+			{
+				const DecodeEntry& entry = tables.decodeTable[reader.Peek(TableBits)];
+				if (entry.length != 0)
+				{
+					output[count++] = (Symbol)entry.symbol;
+					reader.Skip(entry.length);
+				}
+				else
+				{
+					int symbol = longCodeDecoder(reader);
+					if (symbol < 0)
+						break;
+					output[count++] = (Symbol)symbol;
+				}
+			}
+
+			return count;
+		};
+	};
+
+	template <typename Codebook>
+	class FixedCodec // Encoder/decoder for a tree compiled into the binary. Codebook is a generated struct (see Huffman::GenerateCodebook) holding constexpr ROWS and TABLES
+	{
+	public:
+		typedef typename std::remove_const<decltype(Codebook::TABLES)>::type Tables;
+		typedef typename Tables::Symbol Symbol;
+		typedef Codec<Tables::SYMBOL_BITS, Tables::TABLE_BITS, Tables::MAX_CODE_LENGTH> Loops; // Where the shared encode/decode loops live
+
+		static constexpr size_t HEADER_SIZE = BLOCK_MAGIC_SIZE + Tables::ROW_COUNT + 8; // The block marker, the tree-builder rows, then the 8-byte little-endian bit count
+
+		static inline size_t Encode(const Symbol* input, size_t count, BitWriter& writer, size_t limit)
+		{
+			/* Encodes symbols with the compiled-in tables, same contract as Codec::Encode */
+			return Loops::EncodeWith(Codebook::TABLES, input, count, writer, limit);
+		};
+
+		static inline size_t Decode(BitReader& reader, Symbol* output, size_t capacity, size_t stopBit)
+		{
+			/* Decodes symbols with the compiled-in tables, same contract as Codec::Decode, the long codes are handled by DecodeLong */
+			return Loops::DecodeWith(Codebook::TABLES, reader, output, capacity, stopBit, DecodeLong);
+		};
+
+		static inline int DecodeLong(BitReader& reader)
+		{
+			/* Decodes one code longer than the decode table, through the compiled-in flat decode tree */
+			return Loops::WalkTreeWith(Codebook::TABLES, reader);
+		};
+
+		static constexpr size_t MaxBlockSize(size_t count)
+		{
+			/* The most bytes EncodeBlock can write for 'count' symbols */
+			return HEADER_SIZE + (count * Tables::MAX_TREE_DEPTH + 7) / 8 + 8;
+		};
+
+		static size_t EncodeBlock(const Symbol* input, size_t count, unsigned char* output)
+		{
+			/*
+			 * Encodes a whole buffer as one .huf block ([marker][rows][bit count][data]), so the output decodes with the normal -d path too.
+			 * The output has to hold MaxBlockSize(count) bytes. Returns the size of the block.
+			*/
+
+			for (size_t i = 0; i < BLOCK_MAGIC_SIZE; i++)
+				output[i] = BLOCK_MAGIC[i];
+			for (int i = 0; i < Tables::ROW_COUNT; i++)
+				output[BLOCK_MAGIC_SIZE + i] = Codebook::ROWS[i];
+
+			BitWriter writer = { 0, 0, output + HEADER_SIZE, 0 };
+			Encode(input, count, writer, (size_t)-1);
+			unsigned long long bitCount = (unsigned long long)writer.index * 8 + writer.count;
+			writer.Flush();
+
+			for (int i = 0; i < 8; i++)
+				output[BLOCK_MAGIC_SIZE + Tables::ROW_COUNT + i] = (unsigned char)(bitCount >> (8 * i));
+			return HEADER_SIZE + writer.index;
+		};
+
+		static bool DecodeBlock(const unsigned char* block, size_t size, Symbol* output, size_t capacity, size_t& count)
+		{
+			/*
+			 * Decodes one .huf block that was encoded with this tree. The block MUST have 8 readable bytes past its end (see BitReader).
+			 * Returns false if the block isn't this format, was made with a different tree, is cut short, or doesn't fit in the output.
+			*/
+
+			count = 0;
+			if (size < HEADER_SIZE)
+				return false;
+			for (size_t i = 0; i < BLOCK_MAGIC_SIZE; i++)
+				if (block[i] != BLOCK_MAGIC[i])
+					return false;
+			for (int i = 0; i < Tables::ROW_COUNT; i++)
+				if (block[BLOCK_MAGIC_SIZE + i] != Codebook::ROWS[i])
+					return false;
+
+			unsigned long long bitCount = 0;
+			for (int i = 7; i >= 0; i--)
+				bitCount = (bitCount << 8) | block[BLOCK_MAGIC_SIZE + Tables::ROW_COUNT + i];
+			if (bitCount > (unsigned long long)(size - HEADER_SIZE) * 8)
+				return false;
+
+			BitReader reader(block + HEADER_SIZE, (size_t)bitCount);
+			count = Decode(reader, output, capacity, (size_t)bitCount);
+			return reader.Position() == bitCount;
+		};
+	};
+}
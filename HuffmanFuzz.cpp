@@ -0,0 +1,445 @@
+/*
+ * File Name: HuffmanFuzz.cpp
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the implementation of the round-trip and differential fuzz harness of the Huffman class.
+ * Every optimized path (scalar kernel, AVX2 kernel, table decoding) is checked against a plain bit-at-a-time reference of the same format.
+ * Build with HUFFMAN_LIBFUZZER defined (and -fsanitize=fuzzer) to get a libFuzzer target instead of the -fuzz command.
+*/
+
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include "HuffmanFuzz.h"
+#include "ChainCodebook.h"
+
+using namespace std;
+
+HuffmanFuzzer::HuffmanFuzzer(Huffman& huffman) : huffman(huffman)
+{
+	/*
+	 * HuffmanFuzzer constructor, every input is run through the given instance.
+	*/
+}
+
+bool HuffmanFuzzer::FuzzOne(const unsigned char* data, size_t size)
+{
+	/*
+	 * Runs one input through every path, returns false (after printing why) if any of them disagree or fail to round-trip:
+	 *	1. EncodeStream, with the tree built from the input, against the kernels and the reference encoder using the same tree
+	 *	2. A completely lopsided tree, so there are codes of every length up to 255 bits (the long-code paths), through the kernels and
+	 *	   compiled into the binary as ChainCodebook (FixedCodec::EncodeBlock has to write the same block, and DecodeBlock has to round-trip it)
+	 *	3. If the input starts with a valid tree, that tree too (lets a fuzzer pick the trees)
+	 *	4. The sampled tree (-es), and the input split in two and appended, both carrying on the last block (-a) and as a new block (-ab)
+	 *	5. The input itself, and broken copies of the encoded input, as encoded files; they have to not crash, and a bit count past the data has to be rejected
+	*/
+
+	vector<unsigned char> input(data, data + size);
+	string failure;
+	string encoded;
+	string rebuilt;
+
+	// 1. The normal encode
+	istringstream inputStream(string((const char*)data, size), ios::in | ios::binary);
+	stringstream outputStream(ios::in | ios::out | ios::binary);
+	if (!huffman.EncodeStream(inputStream, outputStream))
+		failure = "EncodeStream failed";
+	encoded = outputStream.str();
+
+	if (failure.empty() && encoded.size() < Huffman::BLOCK_HEADER_SIZE)
+		failure = "EncodeStream wrote a short header";
+	if (failure.empty() && FuzzWithTree(input, (const unsigned char*)encoded.data() + HuffmanCore::BLOCK_MAGIC_SIZE, rebuilt, failure) && rebuilt != encoded)
+		failure = "EncodeStream and the encode kernels disagree";
+
+	// 2. The lopsided tree, every merge is with the node at index 0
+	if (failure.empty() && FuzzWithTree(input, ChainCodebook::ROWS, rebuilt, failure))
+		FuzzFixedCodec(input, rebuilt, failure);
+
+	// 3. The input's own tree
+	if (failure.empty() && size >= 510 && huffman.codec.Build(data))
+		FuzzWithTree(input, data, rebuilt, failure);
+
+	// 4. The sampled tree, and appending the second part of the input (from a point picked from the data, so a fuzzer can steer it)
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	if (failure.empty())
+		FuzzSampled(input, failure);
+	if (failure.empty())
+		FuzzAppend(input, hash % (size + 1), false, failure);
+	if (failure.empty())
+		FuzzAppend(input, hash % (size + 1), true, failure);
+
+	// 5. Malformed files
+	if (failure.empty() && !encoded.empty())
+		FuzzMalformed(encoded, data, size, failure);
+
+	if (!failure.empty())
+	{
+		cout << "Fuzz failure on a " << size << " byte input: " << failure << endl;
+		return false;
+	}
+	return true;
+}
+
+int HuffmanFuzzer::Fuzz(int iterations, unsigned int seed)
+{
+	/*
+	 * Runs the hand picked edge cases, then 'iterations' random inputs, through FuzzOne. Returns how many failed.
+	 * The buffer size is cycled down to the smallest allowed, so the buffer boundaries get hit as often as possible.
+	*/
+
+	mt19937 random(seed);
+	vector<vector<unsigned char>> cases;
+	int failures = 0;
+
+	// The edge cases: empty, one byte, one distinct symbol, two symbols, every symbol once, and Fibonacci counts (the deepest tree real data can make)
+	cases.push_back(vector<unsigned char>());
+	cases.push_back(vector<unsigned char>(1, 'x'));
+	cases.push_back(vector<unsigned char>(5000, 'a'));
+	cases.push_back(vector<unsigned char>{ 'a', 'b' });
+	vector<unsigned char> everySymbol;
+	for (int i = 0; i < 256; i++)
+		everySymbol.push_back((unsigned char)i);
+	cases.push_back(everySymbol);
+	vector<unsigned char> fibonacci;
+	for (int i = 0, a = 1, b = 1; i < 22; i++, b = a + b, a = b - a)
+		fibonacci.insert(fibonacci.end(), a, (unsigned char)i);
+	shuffle(fibonacci.begin(), fibonacci.end(), random);
+	cases.push_back(fibonacci);
+
+	size_t bufferSizes[3] = { Huffman::MIN_BUFFER_SIZE, 4096, 65536 };
+	for (int i = 0; i < (int)cases.size() + iterations; i++)
+	{
+		huffman.SetBufferSize(bufferSizes[i % 3]);
+		size_t bufferSize = huffman.GetBufferSize();
+
+		vector<unsigned char> input;
+		if (i < (int)cases.size())
+			input = cases[i];
+		else
+		{
+			// Random length, often right around a multiple of the buffer size
+			size_t length = random() % (3 * bufferSize + 64);
+			if (random() % 4 == 0)
+				length = bufferSize * (1 + random() % 2) + (random() % 17) - 8;
+
+			// Random distribution: uniform bytes, a small alphabet, or heavily skewed
+			int kind = random() % 3;
+			int alphabet = 1 + random() % 256;
+			for (size_t j = 0; j < length; j++)
+			{
+				if (kind == 0)
+					input.push_back((unsigned char)random());
+				else if (kind == 1)
+					input.push_back((unsigned char)(random() % alphabet));
+				else
+				{
+					int symbol = 0;
+					while (symbol < 255 && random() % 3 != 0)
+						symbol++;
+					input.push_back((unsigned char)symbol);
+				}
+			}
+		}
+
+		if (!FuzzOne(input.data(), input.size()))
+			failures++;
+	}
+
+	cout << "Fuzzed " << cases.size() + iterations << " inputs (seed " << seed << "), " << failures << " failures" << endl;
+	return failures;
+}
+
+bool HuffmanFuzzer::FuzzWithTree(const vector<unsigned char>& input, const unsigned char rows[], string& encoded, string& failure)
+{
+	/*
+	 * Encodes the input with the tree in the rows through every kernel and the reference encoder, then decodes it with the table decoder and the reference decoder.
+	 * Leaves the whole encoded file (as EncodeStream would write it) in 'encoded'. Returns false (with the reason in 'failure') on any mismatch.
+	*/
+
+	if (!huffman.codec.Build(rows))
+	{
+		failure = "the codec rejected a valid tree";
+		return false;
+	}
+
+	// The scalar kernel, and the AVX2 kernel if this CPU has it
+	string payloads[2];
+	unsigned long long bitCounts[2] = { 0, 0 };
+	bool hasAVX2 = huffman.useAVX2;
+	for (int kernel = 0; kernel < (hasAVX2 ? 2 : 1); kernel++)
+	{
+		huffman.useAVX2 = kernel == 1;
+		istringstream inputStream(string(input.begin(), input.end()), ios::in | ios::binary);
+		ostringstream outputStream(ios::out | ios::binary);
+		bitCounts[kernel] = huffman.EncodeAndWrite(inputStream, outputStream);
+		payloads[kernel] = outputStream.str();
+	}
+	huffman.useAVX2 = hasAVX2;
+
+	if (hasAVX2 && (payloads[0] != payloads[1] || bitCounts[0] != bitCounts[1]))
+	{
+		failure = "the scalar and AVX2 kernels disagree";
+		return false;
+	}
+
+	// The reference encoder, working from the bStrings of the Node tree
+	string tempBString;
+	Huffman::Node* root = huffman.BuildTree((unsigned char*)rows);
+	huffman.TraverseAndBuild(root, tempBString, huffman.bStrings);
+	unsigned long long referenceBitCount = 0;
+	vector<unsigned char> reference = ReferenceEncode(input, referenceBitCount);
+	if (referenceBitCount != bitCounts[0] || string(reference.begin(), reference.end()) != payloads[0])
+	{
+		failure = "the encode kernels and the reference encoder disagree";
+		return false;
+	}
+
+	// The reference decoder, walking the Node tree a bit at a time
+	if (ReferenceDecode((const unsigned char*)payloads[0].data(), bitCounts[0], root) != input)
+	{
+		failure = "the reference decoder didn't round-trip";
+		return false;
+	}
+
+	// Put the whole file together and decode it the normal way
+	ostringstream fileStream(ios::out | ios::binary);
+	huffman.WriteBlockMagic(fileStream);
+	fileStream.write((const char*)rows, 510);
+	huffman.WriteBlockLength(fileStream, bitCounts[0]);
+	fileStream.write(payloads[0].data(), payloads[0].size());
+	encoded = fileStream.str();
+
+	istringstream inputStream(encoded, ios::in | ios::binary);
+	ostringstream outputStream(ios::out | ios::binary);
+	if (!huffman.DecodeStream(inputStream, outputStream) || outputStream.str() != string(input.begin(), input.end()))
+	{
+		failure = "DecodeStream didn't round-trip";
+		return false;
+	}
+
+	return true;
+}
+
+bool HuffmanFuzzer::FuzzFixedCodec(const vector<unsigned char>& input, const string& encoded, string& failure)
+{
+	/*
+	 * Encodes the input with the compiled-in ChainCodebook, which has to give exactly the block the kernels wrote with the same tree ('encoded'),
+	 * then decodes that block with it. Returns false (with the reason in 'failure') on any mismatch.
+	*/
+
+	vector<unsigned char> block(ChainCodebookCodec::MaxBlockSize(input.size()) + 8); // DecodeBlock reads up to 8 bytes past the block
+	size_t blockSize = ChainCodebookCodec::EncodeBlock(input.data(), input.size(), block.data());
+	if (string(block.begin(), block.begin() + blockSize) != encoded)
+	{
+		failure = "FixedCodec::EncodeBlock and the encode kernels disagree";
+		return false;
+	}
+
+	vector<unsigned char> decoded(input.size() + 1);
+	size_t count = 0;
+	if (!ChainCodebookCodec::DecodeBlock(block.data(), blockSize, decoded.data(), decoded.size(), count) || !equal(input.begin(), input.end(), decoded.begin()) || count != input.size())
+	{
+		failure = "FixedCodec::DecodeBlock didn't round-trip";
+		return false;
+	}
+
+	return true;
+}
+
+bool HuffmanFuzzer::FuzzSampled(const vector<unsigned char>& input, string& failure)
+{
+	/*
+	 * Encodes the input with a sampled tree (-es) and decodes it again. Returns false (with the reason in 'failure') if it didn't round-trip.
+	*/
+
+	istringstream inputStream(string(input.begin(), input.end()), ios::in | ios::binary);
+	stringstream encodedStream(ios::in | ios::out | ios::binary);
+	ostringstream outputStream(ios::out | ios::binary);
+	if (!huffman.EncodeStream(inputStream, encodedStream, true) || !huffman.DecodeStream(encodedStream, outputStream) || outputStream.str() != string(input.begin(), input.end()))
+	{
+		failure = "the sampled tree encode didn't round-trip";
+		return false;
+	}
+
+	return true;
+}
+
+bool HuffmanFuzzer::FuzzAppend(const vector<unsigned char>& input, size_t split, bool newBlock, string& failure)
+{
+	/*
+	 * Appends the input to an empty archive in two parts, split at 'split'. The second part either carries on the first part's block
+	 * (picking up its last partial byte, and adding to its bit count) or gets a new block. The whole input has to decode back out.
+	 * Returns false (with the reason in 'failure') if it didn't.
+	*/
+
+	stringstream archiveStream(ios::in | ios::out | ios::binary);
+	istringstream firstStream(string(input.begin(), input.begin() + split), ios::in | ios::binary);
+	istringstream secondStream(string(input.begin() + split, input.end()), ios::in | ios::binary);
+	if (!huffman.AppendStream(firstStream, archiveStream, true) || !huffman.AppendStream(secondStream, archiveStream, newBlock))
+	{
+		failure = "AppendStream failed";
+		return false;
+	}
+
+	archiveStream.seekg(0);
+	ostringstream outputStream(ios::out | ios::binary);
+	if (!huffman.DecodeStream(archiveStream, outputStream) || outputStream.str() != string(input.begin(), input.end()))
+	{
+		failure = newBlock ? "appending a new block didn't round-trip" : "carrying on the last block didn't round-trip";
+		return false;
+	}
+
+	return true;
+}
+
+bool HuffmanFuzzer::FuzzMalformed(const string& encoded, const unsigned char* data, size_t size, string& failure)
+{
+	/*
+	 * Decodes broken files; the raw fuzz data itself, then copies of a good file with a byte flipped in the marker, the header, the bit count or the data, and cut short.
+	 * Then copies with the boundary bit counts; 0, one bit either side of the real data, a whole byte past it, the counts that wrap (2^64 - 1 and 2^64 - 7),
+	 * and one bit short of the real count, so it ends partway through the last code.
+	 * They all have to not crash (or read out of bounds, under a sanitizer); a count past the data or inside the last code has to be rejected.
+	 * The "not a valid file" messages are muted. Returns false (with the reason in 'failure') if one of those was decoded anyway.
+	*/
+
+	vector<string> files;
+	vector<bool> mustFail; // Set for the files that have to be rejected
+	files.push_back(string((const char*)data, size));
+	mustFail.push_back(false);
+
+	unsigned int hash = 2166136261u; // Pick the positions from the data, so a fuzzer can steer them
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+
+	const size_t headerSize = Huffman::BLOCK_HEADER_SIZE;
+	const size_t rowsStart = HuffmanCore::BLOCK_MAGIC_SIZE;
+	const size_t lengthStart = rowsStart + 510;
+	size_t positions[4] = { hash % rowsStart, rowsStart + hash % 510, lengthStart + hash % Huffman::BLOCK_LENGTH_SIZE,
+		encoded.size() > headerSize ? headerSize + hash % (encoded.size() - headerSize) : 0 };
+	for (int i = 0; i < 4; i++)
+	{
+		string broken = encoded;
+		broken[positions[i]] ^= (char)(1 + hash % 255);
+		files.push_back(broken);
+		mustFail.push_back(false);
+	}
+	files.push_back(encoded.substr(0, hash % (encoded.size() + 1)));
+	mustFail.push_back(false);
+
+	unsigned long long payloadBits = (unsigned long long)(encoded.size() - headerSize) * 8;
+	unsigned long long bitCounts[6] = { 0, payloadBits - 1, payloadBits + 1, payloadBits + 8, ~0ULL, ~0ULL - 6 };
+	for (int i = 0; i < 6; i++)
+	{
+		if (payloadBits == 0 && i == 1)
+			continue; // No data, so there's no count just under it
+		string broken = encoded;
+		for (int b = 0; b < Huffman::BLOCK_LENGTH_SIZE; b++)
+			broken[lengthStart + b] = (char)(bitCounts[i] >> (8 * b));
+		files.push_back(broken);
+		mustFail.push_back(bitCounts[i] > payloadBits);
+	}
+
+	// A bit count that ends partway through the last code, the decoder mustn't finish that code from the padding bits
+	unsigned long long realBits = 0;
+	for (int b = Huffman::BLOCK_LENGTH_SIZE - 1; b >= 0; b--)
+		realBits = (realBits << 8) | (unsigned char)encoded[lengthStart + b];
+	if (size > 0 && huffman.codec.Build((const unsigned char*)encoded.data() + rowsStart) && huffman.codec.tables.lengths[data[size - 1]] > 1)
+	{
+		string broken = encoded;
+		for (int b = 0; b < Huffman::BLOCK_LENGTH_SIZE; b++)
+			broken[lengthStart + b] = (char)((realBits - 1) >> (8 * b));
+		files.push_back(broken);
+		mustFail.push_back(true);
+	}
+
+	streambuf* console = cout.rdbuf(nullptr);
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		istringstream inputStream(files[i], ios::in | ios::binary);
+		ostringstream outputStream(ios::out | ios::binary);
+		if (huffman.DecodeStream(inputStream, outputStream) && mustFail[i] && failure.empty())
+			failure = "a bit count past the end of the data, or inside the last code, wasn't rejected";
+	}
+	cout.rdbuf(console);
+	cout.clear();
+
+	return failure.empty();
+}
+
+vector<unsigned char> HuffmanFuzzer::ReferenceEncode(const vector<unsigned char>& input, unsigned long long& bitCount)
+{
+	/*
+	 * The reference encoder. Goes through the bStrings one '1' or '0' at a time, shifting each bit into place, and pads the last byte with zeros.
+	 * Slow and obvious on purpose.
+	*/
+
+	vector<unsigned char> output;
+	unsigned char currentByte = 0;
+	int bitsInByte = 0;
+	bitCount = 0;
+
+	for (size_t i = 0; i < input.size(); i++)
+	{
+		const string& bString = huffman.bStrings[input[i]];
+		for (size_t j = 0; j < bString.length(); j++)
+		{
+			currentByte = (unsigned char)((currentByte << 1) | (bString[j] == '1' ? 1 : 0));
+			bitsInByte++;
+			bitCount++;
+			if (bitsInByte == 8)
+			{
+				output.push_back(currentByte);
+				currentByte = 0;
+				bitsInByte = 0;
+			}
+		}
+	}
+
+	if (bitsInByte > 0)
+		output.push_back((unsigned char)(currentByte << (8 - bitsInByte)));
+	return output;
+}
+
+vector<unsigned char> HuffmanFuzzer::ReferenceDecode(const unsigned char* payload, unsigned long long bitCount, Huffman::Node* root)
+{
+	/*
+	 * The reference decoder. Steps through the tree one bit at a time, left on a '0' and right on a '1', writing the symbol at each leaf.
+	*/
+
+	vector<unsigned char> output;
+	Huffman::Node* current = root;
+
+	for (unsigned long long i = 0; i < bitCount; i++)
+	{
+		int bit = (payload[i / 8] >> (7 - i % 8)) & 1;
+		current = bit == 0 ? current->left : current->right;
+		if (current->IsLeaf())
+		{
+			output.push_back((unsigned char)current->symbol);
+			current = root;
+		}
+	}
+
+	return output;
+}
+
+#ifdef HUFFMAN_LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size)
+{
+	/*
+	 * libFuzzer entry point. One Huffman instance with the smallest buffers is reused for every input, any failure aborts so the fuzzer saves the input.
+	*/
+
+	static Huffman huffman(2 * Huffman::MIN_BUFFER_SIZE);
+	static HuffmanFuzzer fuzzer(huffman);
+	if (!fuzzer.FuzzOne(data, size))
+		abort();
+	return 0;
+}
+#endif
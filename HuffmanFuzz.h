@@ -0,0 +1,40 @@
+/*
+ * File Name: HuffmanFuzz.h
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the definitions of the round-trip and differential fuzz harness. It's kept out of the Huffman class,
+ * it only gets at the internals it checks (the kernels, the codec, the Node tree) by being a friend of it.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Huffman.h"
+
+using namespace std;
+
+class HuffmanFuzzer
+{
+	/*
+	 * HuffmanFuzzer class. Runs inputs through every encode and decode path of a Huffman instance and checks them against a plain bit-at-a-time reference.
+	*/
+
+public:
+	HuffmanFuzzer(Huffman& huffman);
+
+	bool FuzzOne(const unsigned char* data, size_t size);
+	int Fuzz(int iterations, unsigned int seed);
+
+private:
+	Huffman& huffman; // The instance being fuzzed, its buffer size is changed as it goes
+
+	bool FuzzWithTree(const vector<unsigned char>& input, const unsigned char rows[], string& encoded, string& failure);
+	bool FuzzFixedCodec(const vector<unsigned char>& input, const string& encoded, string& failure);
+	bool FuzzSampled(const vector<unsigned char>& input, string& failure);
+	bool FuzzAppend(const vector<unsigned char>& input, size_t split, bool newBlock, string& failure);
+	bool FuzzMalformed(const string& encoded, const unsigned char* data, size_t size, string& failure);
+	vector<unsigned char> ReferenceEncode(const vector<unsigned char>& input, unsigned long long& bitCount);
+	vector<unsigned char> ReferenceDecode(const unsigned char* payload, unsigned long long bitCount, Huffman::Node* root);
+};
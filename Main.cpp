@@ -12,13 +12,27 @@
 #include <ctime>
 #include <time.h>
 #include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <map>
 #include "Huffman.h"
+#include "HuffmanAsync.h"
+#include "HuffmanFuzz.h"
+#include "Profiler.h"
+#include "BenchmarkSuite.h"
 
 using namespace std;
 
 int GetFileExtensionSize(string filePath);
 streamoff GetFileSize(string filePath);
+void RunBufferBenchmark(Huffman& huffman, string inputFilePath);
+int DecodeMany(string inputPath, string outputDirectory, int threadCount, size_t memoryBudget);
 
+#ifndef HUFFMAN_LIBFUZZER // libFuzzer brings its own main, see HuffmanFuzz.cpp
 int main(int argc, char* argv[])
 {
 	/*
@@ -26,21 +40,53 @@ int main(int argc, char* argv[])
 	*/
 
 	clock_t start = clock();
-	Huffman huffman = Huffman(); // Huffman instance
+	Huffman huffman; // Huffman instance
+	int exitCode = 0; // What main returns, set by the commands that can fail
+	bool reportTime = true; // The single file commands print their time and sizes at the end, the others print their own report
 	string command, inputFilePath, outputFilePath, treeBuilderFilePath, secondOutputFilePath; // Argument declarations
 
+	// Pull out the optional flags first, they can be anywhere on the command line. Everything else is positional.
+	vector<string> args;
+	bool profile = false;
+	size_t workerMemoryBudget = HuffmanAsync::DEFAULT_WORKER_MEMORY_BUDGET; // Only changes if -b is given
+	size_t bufferFlag = 0; // The -b size in bytes, 0 if it wasn't given (passed on by -benchsuite)
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "-b" && i + 1 < argc)
+		{
+			bufferFlag = (size_t)atoll(argv[++i]) * 1024; // The flag is in KB
+			huffman.SetBufferSize(bufferFlag);
+			workerMemoryBudget = huffman.GetBufferSize() * 2;
+		}
+		else if (arg == "--profile")
+			profile = true;
+		else
+			args.push_back(arg);
+	}
+
+	// The profiling hooks only exist if they were compiled in
+	if (profile)
+	{
+#ifdef HUFFMAN_PROFILE
+		Profiler::Enable();
+#else
+		cout << "Profiling isn't compiled in, rebuild with HUFFMAN_PROFILE defined to use --profile" << endl;
+#endif
+	}
+
 	// Pull the args from the supplied cmd args
-	if (argc > 1)
-		command = argv[1];
-	if (argc > 2)
-		inputFilePath = argv[2];
-	if (argc > 3)
+	if (args.size() > 0)
+		command = args[0];
+	if (args.size() > 1)
+		inputFilePath = args[1];
+	if (args.size() > 2)
 	{
-		outputFilePath = argv[3];
-		treeBuilderFilePath = argv[3];
+		outputFilePath = args[2];
+		treeBuilderFilePath = args[2];
 	}
-	if (argc > 4)
-		secondOutputFilePath = argv[4];
+	if (args.size() > 3)
+		secondOutputFilePath = args[3];
 
 	// Check to make sure a non-empty input file path was supplied
 	if (inputFilePath.empty())
@@ -61,7 +107,7 @@ int main(int argc, char* argv[])
 	{
 		cout << "Invalid arguments" << endl;
 	}
-	else if (command == "-e")
+	else if (command == "-e" || command == "-es")
 	{
 		// If the output path isn't supplied, we have the technology to generate it
 		if (outputFilePath.empty())
@@ -73,7 +119,7 @@ int main(int argc, char* argv[])
 				outputFilePath = inputFilePath + ".huf";
 		}
 
-		huffman.EncodeFile(inputFilePath, outputFilePath);
+		exitCode = huffman.EncodeFile(inputFilePath, outputFilePath, command == "-es") ? 0 : -1;
 	}
 	else if (command == "-d")
 	{
@@ -84,7 +130,7 @@ int main(int argc, char* argv[])
 			return -1;
 		}
 
-		huffman.DecodeFile(inputFilePath, outputFilePath);
+		exitCode = huffman.DecodeFile(inputFilePath, outputFilePath) ? 0 : -1;
 	}
 	else if (command == "-t")
 	{
@@ -98,7 +144,7 @@ int main(int argc, char* argv[])
 				outputFilePath = inputFilePath + ".htree";
 		}
 
-		huffman.MakeTreeBuilder(inputFilePath, outputFilePath);
+		exitCode = huffman.MakeTreeBuilder(inputFilePath, outputFilePath) ? 0 : -1;
 	}
 	else if (command == "-et")
 	{
@@ -140,22 +186,93 @@ int main(int argc, char* argv[])
 				secondOutputFilePath = inputFilePath + ".huf";
 		}
 
-		huffman.EncodeFileWithTree(inputFilePath, secondOutputFilePath, treeBuilderFilePath);
+		exitCode = huffman.EncodeFileWithTree(inputFilePath, secondOutputFilePath, treeBuilderFilePath) ? 0 : -1;
+	}
+	else if (command == "-dd")
+	{
+		// Check to make sure a non-empty output directory was supplied
+		if (outputFilePath.empty())
+		{
+			cout << "Output directory is empty" << endl;
+			return -1;
+		}
+
+		exitCode = DecodeMany(inputFilePath, outputFilePath, atoi(secondOutputFilePath.c_str()), workerMemoryBudget);
+		reportTime = false;
+	}
+	else if (command == "-gen")
+	{
+		// Check to make sure a non-empty header file path was supplied
+		if (outputFilePath.empty())
+		{
+			cout << "Header file path is empty" << endl;
+			return -1;
+		}
+
+		exitCode = huffman.GenerateCodebook(inputFilePath, outputFilePath, secondOutputFilePath) ? 0 : -1;
+		reportTime = false;
+	}
+	else if (command == "-a" || command == "-ab")
+	{
+		// Check to make sure a non-empty archive file path was supplied
+		if (outputFilePath.empty())
+		{
+			cout << "Archive file path is empty" << endl;
+			return -1;
+		}
+
+		exitCode = huffman.AppendFile(inputFilePath, outputFilePath, command == "-ab") ? 0 : -1;
+	}
+	else if (command == "-stats" || command == "-analyze")
+	{
+		huffman.AnalyzeFile(inputFilePath);
+		reportTime = false;
+	}
+	else if (command == "-bench")
+	{
+		RunBufferBenchmark(huffman, inputFilePath);
+		reportTime = false;
+	}
+	else if (command == "-benchsuite")
+	{
+		// The work directory is in the input file path slot, then the largest corpus in MB (optional) and a label for the history (optional)
+		unsigned long long maxCorpusSize = outputFilePath.empty() ? BenchmarkSuite::DEFAULT_MAX_CORPUS_SIZE : strtoull(outputFilePath.c_str(), nullptr, 10) * 1024 * 1024;
+		BenchmarkSuite suite(argv[0], inputFilePath, maxCorpusSize, secondOutputFilePath, bufferFlag);
+		exitCode = suite.Run();
+		reportTime = false;
+	}
+	else if (command == "-fuzz")
+	{
+		// The iteration count is in the input file path slot, the seed (optional) in the output one
+		unsigned int seed = outputFilePath.empty() ? (unsigned int)time(nullptr) : (unsigned int)strtoul(outputFilePath.c_str(), nullptr, 10);
+		HuffmanFuzzer fuzzer(huffman);
+		exitCode = fuzzer.Fuzz(atoi(inputFilePath.c_str()), seed) == 0 ? 0 : -1;
+		reportTime = false;
 	}
 	else if (command == "-h" || command == "-?" || command == "-help")
 	{
 		huffman.DisplayHelp();
-		return 0;
+		reportTime = false;
 	}
 
 	// Calculate the bytes read and written based upon file sizes and commands. Write that data to the console.
-	clock_t end = clock();
-	double elapsed = ((double)(end - start)) / CLOCKS_PER_SEC;
-	streamoff inputBytes = command == "-et" ? GetFileSize(inputFilePath) + GetFileSize(treeBuilderFilePath) : GetFileSize(inputFilePath); // Get the input (COMBINED) bytes
-	streamoff outputBytes = command == "-et" ? GetFileSize(secondOutputFilePath) : GetFileSize(outputFilePath); // Get the output bytes
-	cout << "Time: " << setprecision(4) << elapsed << " seconds. " << inputBytes << " bytes in / " << outputBytes << " bytes out" << endl; // MUST set precision of the output stream before writing the time!!!
-	return 0;
+	if (reportTime)
+	{
+		clock_t end = clock();
+		double elapsed = ((double)(end - start)) / CLOCKS_PER_SEC;
+		streamoff inputBytes = command == "-et" ? GetFileSize(inputFilePath) + GetFileSize(treeBuilderFilePath) : GetFileSize(inputFilePath); // Get the input (COMBINED) bytes
+		streamoff outputBytes = command == "-et" ? GetFileSize(secondOutputFilePath) : GetFileSize(outputFilePath); // Get the output bytes
+		cout << "Time: " << setprecision(4) << elapsed << " seconds. " << inputBytes << " bytes in / " << outputBytes << " bytes out" << endl; // MUST set precision of the output stream before writing the time!!!
+	}
+
+	// Every command that ran gets here, so --profile reports on all of them
+#ifdef HUFFMAN_PROFILE
+	if (profile)
+		Profiler::Report(cout);
+#endif
+	return exitCode;
 }
+#endif
 
 int GetFileExtensionSize(string filePath)
 {
@@ -176,7 +293,170 @@ streamoff GetFileSize(string filePath)
 	 */
 
 	ifstream stream(filePath, ios::binary | ios::ate); // Open the stream at the end, in binary
-	streamoff size = stream.is_open() ? (int)stream.tellg() : 0; // If it opened correctly, get the head position, else 0
+	streamoff size = stream.is_open() ? (streamoff)stream.tellg() : 0; // If it opened correctly, get the head position, else 0 (NOT an int, files can be over 2GB)
 	stream.close(); // Close the file to free resources
 	return size; // Return the found size, or zero
-}
\ No newline at end of file
+}
+void RunBufferBenchmark(Huffman& huffman, string inputFilePath)
+{
+	/*
+	 * Helper function that encodes and decodes a file with a range of buffer sizes, printing the throughput of each.
+	 * Used for picking the -b setting for a given machine. The temporary files are written next to the input file and removed afterwards.
+	 */
+
+	string encodedFilePath = inputFilePath + ".bench.huf";
+	string decodedFilePath = inputFilePath + ".bench.out";
+	double megaBytes = GetFileSize(inputFilePath) / (1024.0 * 1024.0);
+
+	cout << setw(12) << "Buffer (KB)" << setw(16) << "Encode (MB/s)" << setw(16) << "Decode (MB/s)" << endl;
+	for (size_t size = 16 * 1024; size <= 64 * 1024 * 1024; size *= 4)
+	{
+		huffman.SetBufferSize(size);
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		huffman.EncodeFile(inputFilePath, encodedFilePath);
+		chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+		huffman.DecodeFile(encodedFilePath, decodedFilePath);
+		chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+		double encodeSeconds = chrono::duration<double>(middle - start).count();
+		double decodeSeconds = chrono::duration<double>(end - middle).count();
+		cout << setw(12) << huffman.GetBufferSize() / 1024 << fixed << setprecision(1) << setw(16) << megaBytes / encodeSeconds << setw(16) << megaBytes / decodeSeconds << endl;
+	}
+
+	remove(encodedFilePath.c_str());
+	remove(decodedFilePath.c_str());
+}
+
+int DecodeMany(string inputPath, string outputDirectory, int threadCount, size_t memoryBudget)
+{
+	/*
+	 * Helper function that decodes a whole directory (every .huf file in it, recursively) or a list file (one .huf path per line) on a pool of threads.
+	 * Each decoded file goes to the same relative path under outputDirectory, without the .huf extension. Files that would land outside outputDirectory,
+	 * or on top of another file's output, are skipped (and counted as failures).
+	 * Every worker keeps its own buffers and decode tables for all the files it decodes. Returns -1 if any file failed.
+	 */
+
+	namespace fs = std::filesystem;
+	vector<fs::path> inputFiles; // Every file to decode
+	vector<fs::path> relativePaths; // Where each one goes, relative to the output directory
+	error_code error;
+
+	if (fs::is_directory(inputPath, error))
+	{
+		for (fs::recursive_directory_iterator it(inputPath, error), end; it != end; it.increment(error))
+		{
+			if (error)
+				break;
+			if (it->is_regular_file(error) && it->path().extension() == ".huf")
+			{
+				inputFiles.push_back(it->path());
+				relativePaths.push_back(it->path().lexically_relative(inputPath));
+			}
+		}
+	}
+	else
+	{
+		ifstream listStream(inputPath);
+		if (!listStream.is_open())
+		{
+			cout << "Input directory or list file cannot be opened!" << endl;
+			return -1;
+		}
+
+		string line;
+		while (getline(listStream, line))
+		{
+			if (!line.empty() && line.back() == '\r') // Lists written on Windows
+				line.pop_back();
+			if (line.empty())
+				continue;
+
+			fs::path path(line);
+			inputFiles.push_back(path);
+			relativePaths.push_back(path.is_absolute() ? path.filename() : path.relative_path()); // Absolute paths can't be kept relative, so they just keep their name
+		}
+	}
+
+	// Work out every output path before anything is decoded. A list file can hold anything, so each path is normalized and has to stay inside
+	// the output directory (no '..' climbing out, no symlinked directory leading out of it), and no two inputs may decode to the same file.
+	int failures = 0;
+	fs::path outputRoot = fs::weakly_canonical(fs::absolute(outputDirectory, error), error);
+	map<string, size_t> outputOwners; // Each output path, and the input that's decoding to it
+	vector<fs::path> outputPaths(inputFiles.size()); // Where each input is decoded to, empty if it was skipped
+	for (size_t i = 0; i < inputFiles.size(); i++)
+	{
+		fs::path relativePath = relativePaths[i].lexically_normal();
+		fs::path outputPath = outputRoot / relativePath;
+		outputPath.replace_extension(); // Drop the .huf
+		outputPath = fs::weakly_canonical(outputPath, error); // Follows any symlinks that are already there
+		fs::path insideRoot = outputPath.lexically_relative(outputRoot);
+		if (relativePath.empty() || insideRoot.empty() || *insideRoot.begin() == ".." || *insideRoot.begin() == ".")
+		{
+			cout << "Skipping " << inputFiles[i].string() << ", it would be decoded outside the output directory!" << endl;
+			failures++;
+			continue;
+		}
+
+		map<string, size_t>::iterator owner = outputOwners.find(outputPath.string());
+		if (owner != outputOwners.end())
+		{
+			cout << "Skipping " << inputFiles[i].string() << ", it would be decoded to the same file as " << inputFiles[owner->second].string() << "!" << endl;
+			failures++;
+			continue;
+		}
+
+		outputOwners[outputPath.string()] = i;
+		outputPaths[i] = outputPath;
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	HuffmanAsync pool(threadCount, HuffmanAsync::DEFAULT_QUEUE_DEPTH, memoryBudget);
+	vector<future<bool>> results(inputFiles.size());
+
+	for (size_t i = 0; i < inputFiles.size(); i++)
+	{
+		if (outputPaths[i].empty())
+			continue;
+		fs::create_directories(outputPaths[i].parent_path(), error);
+		results[i] = pool.DecodeFileAsync(inputFiles[i].string(), outputPaths[i].string()); // Blocks while the queue is full
+	}
+
+	// Wait for everything, tallying the failures and the bytes as we go
+	size_t decoded = 0;
+	streamoff inputBytes = 0;
+	streamoff outputBytes = 0;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		if (!results[i].valid())
+			continue; // Skipped, already counted as a failure
+
+		bool success = false;
+		try
+		{
+			success = results[i].get();
+		}
+		catch (...)
+		{
+			success = false; // The worker threw, e.g. it ran out of memory
+		}
+
+		if (!success)
+		{
+			cout << "Failed to decode " << inputFiles[i].string() << endl;
+			fs::remove(outputPaths[i], error); // Don't leave an empty or partial file behind
+			failures++;
+			continue; // Only the files that decoded count towards the bytes
+		}
+
+		decoded++;
+		inputBytes += GetFileSize(inputFiles[i].string());
+		outputBytes += GetFileSize(outputPaths[i].string());
+	}
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << "Decoded " << decoded << " of " << inputFiles.size() << " files on " << pool.GetThreadCount() << " threads. "
+		<< "Time: " << setprecision(4) << seconds << " seconds. " << inputBytes << " bytes in / " << outputBytes << " bytes out ("
+		<< fixed << setprecision(1) << (seconds > 0 ? outputBytes / (1024.0 * 1024.0) / seconds : 0) << " MB/s decoded)" << endl;
+	return failures > 0 ? -1 : 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * File Name: Profiler.cpp
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the implementation of the optional profiling hooks. It's empty unless HUFFMAN_PROFILE is defined.
+*/
+
+#include "Profiler.h"
+
+#ifdef HUFFMAN_PROFILE
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define PROFILER_HAS_TSC
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static atomic<bool> enabled(false); // Set by --profile, the scopes do nothing until then
+static atomic<unsigned long long> cycleTotals[Profiler::PHASE_COUNT]; // Cycles spent in each phase
+static atomic<unsigned long long> branchMissTotals[Profiler::PHASE_COUNT]; // Branch misses in each phase
+static atomic<unsigned long long> cacheMissTotals[Profiler::PHASE_COUNT]; // Cache misses in each phase
+static atomic<unsigned long long> byteTotals[Profiler::PHASE_COUNT]; // Bytes processed by each phase
+static atomic<unsigned long long> symbolTotals[Profiler::PHASE_COUNT]; // Symbols emitted by each phase
+static atomic<unsigned long long> callTotals[Profiler::PHASE_COUNT]; // How many times each phase ran
+static atomic<bool> usingPerf(false); // Set once any thread manages to open its perf counters
+
+#ifdef __linux__
+struct PerfCounters // One thread's perf counters, closed when the thread exits
+{
+	int fds[3] = { -1, -1, -1 }; // The cycles (the group leader), branch misses and cache misses counters, -1 when not open
+	bool opened = false; // Set once opening them has been tried, whether it worked or not
+
+	void Close()
+	{
+		/* Closes every counter that's open */
+		for (int i = 0; i < 3; i++)
+		{
+			if (fds[i] >= 0)
+				close(fds[i]);
+			fds[i] = -1;
+		}
+	};
+
+	~PerfCounters()
+	{
+		/* PerfCounters destructor, runs as the thread exits */
+		Close();
+	};
+};
+
+static thread_local PerfCounters perfCounters;
+
+static int OpenCounter(unsigned int type, unsigned long long config, int groupFd)
+{
+	/*
+	 * Opens one perf counter for the calling thread (user space only). The leader starts disabled, so the whole group can be enabled together.
+	*/
+
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = groupFd == -1 ? 1 : 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+static void OpenCounters()
+{
+	/*
+	 * Opens the cycles, branch misses and cache misses counters as one group. If any of them can't be opened (no PMU, perf_event_paranoid...) we go without,
+	 * closing the ones that did open. Anything still open from before is closed first.
+	*/
+
+	perfCounters.Close();
+	perfCounters.opened = true;
+
+	perfCounters.fds[0] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+	if (perfCounters.fds[0] < 0)
+		return;
+
+	perfCounters.fds[1] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, perfCounters.fds[0]);
+	if (perfCounters.fds[1] >= 0)
+		perfCounters.fds[2] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, perfCounters.fds[0]);
+	if (perfCounters.fds[1] < 0 || perfCounters.fds[2] < 0)
+	{
+		perfCounters.Close();
+		return;
+	}
+
+	ioctl(perfCounters.fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perfCounters.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	usingPerf = true;
+}
+#endif
+
+void Profiler::Enable()
+{
+	/*
+	 * Turns the profiling scopes on.
+	*/
+
+	enabled = true;
+}
+
+bool Profiler::IsEnabled()
+{
+	/*
+	 * Returns whether the profiling scopes are on.
+	*/
+
+	return enabled.load(memory_order_relaxed);
+}
+
+Profiler::Sample Profiler::Read()
+{
+	/*
+	 * Takes a snapshot of the counters for the calling thread.
+	*/
+
+	Sample sample = { 0, 0, 0 };
+
+#ifdef __linux__
+	if (!perfCounters.opened)
+		OpenCounters();
+	if (perfCounters.fds[0] >= 0)
+	{
+		unsigned long long values[4]; // The number of counters, then the cycles, branch misses and cache misses
+		if (read(perfCounters.fds[0], values, sizeof(values)) == (ssize_t)sizeof(values))
+		{
+			sample.cycles = values[1];
+			sample.branchMisses = values[2];
+			sample.cacheMisses = values[3];
+			return sample;
+		}
+	}
+#endif
+
+#ifdef PROFILER_HAS_TSC
+	sample.cycles = __rdtsc();
+#else
+	sample.cycles = (unsigned long long)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count(); // No cycle counter, nanoseconds will have to do
+#endif
+	return sample;
+}
+
+void Profiler::Add(Phase phase, const Sample& start, const Sample& end)
+{
+	/*
+	 * Adds the difference between two snapshots to a phase.
+	*/
+
+	cycleTotals[phase] += end.cycles - start.cycles;
+	branchMissTotals[phase] += end.branchMisses - start.branchMisses;
+	cacheMissTotals[phase] += end.cacheMisses - start.cacheMisses;
+	callTotals[phase]++;
+}
+
+void Profiler::Count(Phase phase, unsigned long long bytes, unsigned long long symbols)
+{
+	/*
+	 * Adds how many bytes were processed and how many symbols were emitted to a phase.
+	*/
+
+	if (!IsEnabled())
+		return;
+	byteTotals[phase] += bytes;
+	symbolTotals[phase] += symbols;
+}
+
+void Profiler::Report(ostream& outputStream)
+{
+	/*
+	 * Prints the per-phase breakdown, skipping the phases that never ran.
+	*/
+
+	const char* names[PHASE_COUNT] = { "Frequency counts", "Build subtrees", "Encode", "Decode" };
+
+	outputStream << endl << (usingPerf ? "Profile (perf counters):" : "Profile (time stamp counter, no perf counters available):") << endl;
+	outputStream << left << setw(18) << "Phase" << right << setw(8) << "Calls" << setw(16) << "Cycles" << setw(14) << "Bytes" << setw(14) << "Symbols"
+		<< setw(14) << "Cycles/byte" << setw(14) << "Branch miss" << setw(14) << "Cache miss" << endl;
+
+	for (int i = 0; i < PHASE_COUNT; i++)
+	{
+		if (callTotals[i] == 0)
+			continue;
+
+		outputStream << left << setw(18) << names[i] << right << setw(8) << callTotals[i] << setw(16) << cycleTotals[i] << setw(14) << byteTotals[i] << setw(14) << symbolTotals[i];
+		if (byteTotals[i] > 0)
+			outputStream << setw(14) << fixed << setprecision(2) << (double)cycleTotals[i] / byteTotals[i];
+		else
+			outputStream << setw(14) << "-";
+		if (usingPerf)
+			outputStream << setw(14) << branchMissTotals[i] << setw(14) << cacheMissTotals[i];
+		else
+			outputStream << setw(14) << "n/a" << setw(14) << "n/a";
+		outputStream << endl;
+	}
+}
+
+#endif
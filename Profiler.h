@@ -0,0 +1,82 @@
+/*
+ * File Name: Profiler.h
+ * Date: 10/18/2019
+ * Course: EECS 2510 Non-Linear Data Structures
+ * Author: Mike Baldwin
+ * Brief Description: This file contains the optional hot-path profiling hooks. They are only compiled in when HUFFMAN_PROFILE is defined,
+ * otherwise the HUFFMAN_PROFILE_* macros expand to nothing and cost nothing.
+*/
+
+#pragma once
+
+#ifdef HUFFMAN_PROFILE
+
+#include <ostream>
+
+using namespace std;
+
+class Profiler
+{
+	/*
+	 * Profiler class. Adds up cycles, bytes, symbols and (on Linux, through perf_event_open) branch and cache misses for each phase of the codec.
+	 * Every thread gets its own hardware counters, the totals are shared.
+	*/
+
+public:
+	enum Phase // The instrumented phases, one per hot function
+	{
+		FREQUENCY_COUNTS, // CalculateFrequencyCounts
+		BUILD_SUBTREE, // BuildSubTrees, all 255 merges of one tree
+		ENCODE, // EncodeAndWrite
+		DECODE, // DecodeAndWrite
+		PHASE_COUNT
+	};
+
+	struct Sample // A snapshot of the counters
+	{
+		unsigned long long cycles; // CPU cycles (from perf if it's there, otherwise the time stamp counter)
+		unsigned long long branchMisses; // Mispredicted branches, 0 without perf
+		unsigned long long cacheMisses; // Last level cache misses, 0 without perf
+	};
+
+	class Scope // Measures from construction to destruction, and adds that to a phase
+	{
+	public:
+		Scope(Phase phase)
+		{
+			/* Scope constructor, takes the starting snapshot */
+			this->phase = phase;
+			if (Profiler::IsEnabled())
+				start = Profiler::Read();
+		};
+		~Scope()
+		{
+			/* Scope destructor, adds the difference since the starting snapshot to the phase */
+			if (Profiler::IsEnabled())
+				Profiler::Add(phase, start, Profiler::Read());
+		};
+
+	private:
+		Phase phase; // The phase this scope is adding to
+		Sample start; // The starting snapshot
+	};
+
+	static void Enable();
+	static bool IsEnabled();
+	static Sample Read();
+	static void Add(Phase phase, const Sample& start, const Sample& end);
+	static void Count(Phase phase, unsigned long long bytes, unsigned long long symbols);
+	static void Report(ostream& outputStream);
+};
+
+#define HUFFMAN_PROFILE_JOIN(a, b) a##b
+#define HUFFMAN_PROFILE_NAME(line) HUFFMAN_PROFILE_JOIN(profileScope, line)
+#define HUFFMAN_PROFILE_SCOPE(phase) Profiler::Scope HUFFMAN_PROFILE_NAME(__LINE__)(Profiler::phase) // Profiles the rest of the enclosing block as 'phase'
+#define HUFFMAN_PROFILE_COUNT(phase, bytes, symbols) Profiler::Count(Profiler::phase, bytes, symbols) // Adds bytes and symbols processed to 'phase'
+
+#else
+
+#define HUFFMAN_PROFILE_SCOPE(phase)
+#define HUFFMAN_PROFILE_COUNT(phase, bytes, symbols)
+
+#endif